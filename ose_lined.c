@@ -23,6 +23,33 @@
 
 /* memmove */
 #include <string.h>
+/* snprintf */
+#include <stdio.h>
+/* realloc */
+#include <stdlib.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef OSE_LINED_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif !defined(__aarch64__)
+#include <time.h>
+#endif
+#endif
+/*
+   history file: /lined/hist/load and /lined/hist/save need POSIX
+   files, so they're only built with OSE_LINED_HISTFILE
+*/
+#ifdef OSE_LINED_HISTFILE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "ose_conf.h"
 #include "ose.h"
@@ -31,17 +58,77 @@
 #include "ose_stackops.h"
 #include "ose_assert.h"
 #include "ose_vm.h"
-#include "ose_print.h"
 
 #define OSE_LINED_BUFSIZE 4096
+/* size of the reverse search query blob, including the null */
+#define OSE_LINED_SEARCHMAX 64
+/* 
+   longest /lo/wb whose compiled bitmap is kept across calls; a
+   longer one is recompiled on every call
+*/
+#define OSE_LINED_WBMAX 64
+/* most word break chars the vector scans compare against */
+#define OSE_LINED_WBSIMDMAX 8
 
 #define BUFSIZE_OFFSET (OSE_BUNDLE_HEADER_LEN + 12)
 #define BUFLEN_OFFSET (BUFSIZE_OFFSET + 16)
 #define CURPOS_OFFSET (BUFLEN_OFFSET + 16)
-/* placeholder until we actually keep track of cols */
-#define COLS_OFFSET CURPOS_OFFSET /* (CURPOS_OFFSET + 16) */
+/* display columns: of the cursor, and of the whole line */
+#define COLS_OFFSET (CURPOS_OFFSET + 16)
+#define LINECOLS_OFFSET (COLS_OFFSET + 4)
+/* 
+   redraw state: first damaged position, and what the terminal shows,
+   in columns: the width of the line, and the cursor and end of the
+   line as laid out on the terminal
+*/
+#define DIRTY_OFFSET (LINECOLS_OFFSET + 20)
+#define TERMLEN_OFFSET (DIRTY_OFFSET + 4)
+#define TERMPOS_OFFSET (TERMLEN_OFFSET + 4)
+#define TERMEND_OFFSET (TERMPOS_OFFSET + 4)
+/* 
+   input decoder state: state, CSI parameter, and bytes of the
+   bracketed paste end marker seen so far
+*/
+#define INSTATE_OFFSET (TERMEND_OFFSET + 20)
+#define INPARAM_OFFSET (INSTATE_OFFSET + 4)
+#define PASTEMATCH_OFFSET (INPARAM_OFFSET + 4)
+/*
+  reverse history search: 0 if not searching, 1 if the query
+  matches, 2 if it doesn't; age of the matching history entry; length
+  of the query; the query
+*/
+#define SEARCH_OFFSET (PASTEMATCH_OFFSET + 20)
+#define SEARCHAGE_OFFSET (SEARCH_OFFSET + 4)
+#define SEARCHLEN_OFFSET (SEARCHAGE_OFFSET + 4)
+#define SEARCHQUERY_OFFSET (SEARCHLEN_OFFSET + 8)
+/* 
+   pointer to the heap buffer that replaces /bf once the line
+   outgrows it, or NULL
+*/
+#define HEAPBUF_OFFSET (SEARCHQUERY_OFFSET + OSE_LINED_SEARCHMAX + 16)
+/* 
+   /lo/wb compiled into a bitmap with one bit per byte value, and the
+   string it was compiled from
+*/
+#define WBMAP_OFFSET (HEAPBUF_OFFSET + 8 + 16)
+#define WBSRC_OFFSET (WBMAP_OFFSET + 32 + 4)
+/* 
+   kill ring state: what the last key did (one of the CMD_ values),
+   and the length of the text the last yank inserted
+*/
+#define LASTCMD_OFFSET (WBSRC_OFFSET + OSE_LINED_WBMAX + 12)
+#define YANKLEN_OFFSET (LASTCMD_OFFSET + 4)
 /* skips over the size of the blob */
-#define BUF_OFFSET (COLS_OFFSET + 20)
+#define BUF_OFFSET (YANKLEN_OFFSET + 4 + 16)
+/* 
+   wide glyphs the terminal put at the start of the next row, leaving
+   the last column of a row blank, in the line as last printed: how
+   many there are (-1 if that isn't known), the width the line was
+   wrapped at, and the column of each, in columns of text, in order
+*/
+#define PADCOUNT_OFFSET (BUF_OFFSET + OSE_LINED_BUFSIZE + 16)
+#define PADWIDTH_OFFSET (PADCOUNT_OFFSET + 4)
+#define PADS_OFFSET (PADWIDTH_OFFSET + 8)
 
 #define BUFSIZE ose_readInt32(ose_getBundlePtr(vm_le), \
                               BUFSIZE_OFFSET)
@@ -49,19 +136,131 @@
 #define CURPOS ose_readInt32(ose_getBundlePtr(vm_le), CURPOS_OFFSET)
 #define BUFP ose_getBundlePtr(vm_le) + BUF_OFFSET
 
-#define PROMPTSTRING_OFFSET (OSE_BUNDLE_HEADER_LEN + 12)
+#define BRACKETEDPASTE_OFFSET (OSE_BUNDLE_HEADER_LEN + 12)
+#define BUFMAX_OFFSET (BRACKETEDPASTE_OFFSET + 16)
+/* terminal width, 0 if lines shouldn't be wrapped */
+#define TERMWIDTH_OFFSET (BUFMAX_OFFSET + 16)
+/* 
+   key dispatch tables: the ACT_ action for each key, and for each
+   key after ESC
+*/
+#define KEYTABLE_OFFSET (TERMWIDTH_OFFSET + 20)
+#define METATABLE_OFFSET (KEYTABLE_OFFSET + 256 + 16)
+/* 
+   /lined/format limits: elements shown per bundle, and depth of
+   nested bundles shown; 0 for no limit
+*/
+#define FORMATELEMS_OFFSET (METATABLE_OFFSET + 256 + 12)
+#define FORMATDEPTH_OFFSET (FORMATELEMS_OFFSET + 4)
+#define PROMPTSTRING_OFFSET (FORMATELEMS_OFFSET + 20)
 #define PROMPTSTRING ose_getBundlePtr(vm_lo) + PROMPTSTRING_OFFSET
 #define WORDBREAKCHARS_OFFSET PROMPTSTRING_OFFSET + \
     (ose_pstrlen(PROMPTSTRING) + 12)
 #define WORDBREAKCHARS ose_getBundlePtr(vm_lo) +    \
     WORDBREAKCHARS_OFFSET
 
+/*
+  Rings: a fixed-size store of byte strings that appends at the head
+  and evicts from the tail. A ring is three consecutive messages: a
+  header with four ints (count, an owner-defined position, the index
+  slot of the oldest entry, and the offset in the data blob where the
+  next entry goes), an index blob with the data offset of each entry,
+  and the data blob itself. Each entry in the data is its length
+  followed by the bytes and a terminating null, padded to 4 bytes.
+  The macros take the offset of the count.
+*/
+#define RING_COUNT(o) (o)
+#define RING_POS(o) ((o) + 4)
+#define RING_FIRST(o) ((o) + 8)
+#define RING_HEAD(o) ((o) + 12)
+#define RING_INDEXSIZE(o) ((o) + 28)
+#define RING_INDEX(o) ((o) + 32)
+
+/* 
+   /lh is a ring: /en (count, current history number, ...), /hx (the
+   index) and /hd (the entries), followed by /hs, a 128-bit signature
+   of the bigrams in each entry, by index slot
+*/
+#define HISTCOUNT_OFFSET (OSE_BUNDLE_HEADER_LEN + 16)
+#define HISTNUM_OFFSET RING_POS(HISTCOUNT_OFFSET)
+#define HISTSIG_OFFSET (RING_INDEX(HISTCOUNT_OFFSET)         \
+                        + OSE_LINED_HISTMAX * 4 + 16        \
+                        + OSE_LINED_HISTDATASIZE + 16)
+/*
+  /lk is a ring too: /lk (count, age of the last yanked entry, ...),
+  /kx (the index) and /kd (the killed text)
+*/
+#define KILLCOUNT_OFFSET (OSE_BUNDLE_HEADER_LEN + 16)
+#define KILLYANK_OFFSET RING_POS(KILLCOUNT_OFFSET)
+
+/*
+  /lu, the undo log, is a ring of edit records: /lu (count, number of
+  newest records that have been undone, ...), /ux and /ud. A record
+  is the position of the edit, its kind (UNDO_ flags), and the bytes
+  that were inserted or deleted.
+*/
+#define UNDOCOUNT_OFFSET (OSE_BUNDLE_HEADER_LEN + 16)
+#define UNDONE_OFFSET RING_POS(UNDOCOUNT_OFFSET)
+
+/* /ls/ss: a byte of SESSION_ flags for each session */
+#define SESSIONSTATE_OFFSET (OSE_BUNDLE_HEADER_LEN + 16)
+
+/*
+  /lc, the completion index, shared by all sessions: /cn (number of
+  addresses, how far into the env they've been indexed, the offset of
+  the free space in /cd, the offset of the last env element indexed
+  (0 if there isn't one) and a hash of it, and whether an address
+  didn't fit), /cx (offsets of the addresses in /cd, in sorted
+  order), and /cd (the addresses, null terminated)
+*/
+#define COMPLETECOUNT_OFFSET (OSE_BUNDLE_HEADER_LEN + 16)
+#define COMPLETEENV_OFFSET (COMPLETECOUNT_OFFSET + 4)
+#define COMPLETEHEAD_OFFSET (COMPLETECOUNT_OFFSET + 8)
+#define COMPLETELAST_OFFSET (COMPLETECOUNT_OFFSET + 12)
+#define COMPLETEHASH_OFFSET (COMPLETECOUNT_OFFSET + 16)
+#define COMPLETEFULL_OFFSET (COMPLETECOUNT_OFFSET + 20)
+#define COMPLETEINDEX_OFFSET (COMPLETECOUNT_OFFSET + 40)
+#define COMPLETEDATA_OFFSET (COMPLETEINDEX_OFFSET                  \
+                             + OSE_LINED_COMPLETEMAX * 4 + 16)
+
+/*
+  /lf: descriptor of the history file new entries are appended to (-1
+  if there isn't one), and the number of newest entries that haven't
+  been written to a file yet
+*/
+#define HISTFD_OFFSET (HISTSIG_OFFSET + OSE_LINED_HISTMAX * 16 + 12)
+#define HISTUNSAVED_OFFSET (HISTFD_OFFSET + 4)
+
 #ifdef OSE_DEBUG
 const int32_t bufsize_offset = BUFSIZE_OFFSET;
 const int32_t buflen_offset = BUFLEN_OFFSET;
 const int32_t curpos_offset = CURPOS_OFFSET;
 const int32_t cols_offset = COLS_OFFSET;
+const int32_t linecols_offset = LINECOLS_OFFSET;
+const int32_t dirty_offset = DIRTY_OFFSET;
+const int32_t termlen_offset = TERMLEN_OFFSET;
+const int32_t termpos_offset = TERMPOS_OFFSET;
+const int32_t termend_offset = TERMEND_OFFSET;
+const int32_t instate_offset = INSTATE_OFFSET;
+const int32_t inparam_offset = INPARAM_OFFSET;
+const int32_t pastematch_offset = PASTEMATCH_OFFSET;
+const int32_t search_offset = SEARCH_OFFSET;
+const int32_t searchage_offset = SEARCHAGE_OFFSET;
+const int32_t searchlen_offset = SEARCHLEN_OFFSET;
+const int32_t searchquery_offset = SEARCHQUERY_OFFSET;
+const int32_t heapbuf_offset = HEAPBUF_OFFSET;
+const int32_t wbmap_offset = WBMAP_OFFSET;
+const int32_t wbsrc_offset = WBSRC_OFFSET;
+const int32_t lastcmd_offset = LASTCMD_OFFSET;
+const int32_t yanklen_offset = YANKLEN_OFFSET;
 const int32_t buf_offset = BUF_OFFSET;
+const int32_t bracketedpaste_offset = BRACKETEDPASTE_OFFSET;
+const int32_t bufmax_offset = BUFMAX_OFFSET;
+const int32_t termwidth_offset = TERMWIDTH_OFFSET;
+const int32_t keytable_offset = KEYTABLE_OFFSET;
+const int32_t metatable_offset = METATABLE_OFFSET;
+const int32_t formatelems_offset = FORMATELEMS_OFFSET;
+const int32_t formatdepth_offset = FORMATDEPTH_OFFSET;
 const int32_t promptstring_offset = PROMPTSTRING_OFFSET;
 #endif
 
@@ -76,194 +275,700 @@ const int32_t promptstring_offset = PROMPTSTRING_OFFSET;
 #define SPC 32
 #define DEL 127
 
+#define OSE_LINED_BRACKETEDPASTE 1
+/* 
+   the edit buffer moves to the heap and grows up to this size when a
+   line doesn't fit in /bf. Set it to OSE_LINED_BUFSIZE to never
+   allocate.
+*/
+#ifndef OSE_LINED_BUFMAX
+#define OSE_LINED_BUFMAX 65536
+#endif
+/* 
+   width of the terminal the line is wrapped at, or 0 if it isn't
+   wrapped. The host sets /lo/tw to the width of the terminal, and
+   again when the terminal is resized.
+*/
+#ifndef OSE_LINED_TERMWIDTH
+#define OSE_LINED_TERMWIDTH 0
+#endif
+/* most wide glyphs at the start of a row that /le/lp keeps */
+#ifndef OSE_LINED_MAXPADS
+#define OSE_LINED_MAXPADS 64
+#endif
+/* 
+   /lined/format summarizes bundles with more elements, or nested
+   more deeply, than this. /lo/fl can be changed at runtime.
+*/
+#ifndef OSE_LINED_FORMATMAXELEMS
+#define OSE_LINED_FORMATMAXELEMS 0
+#endif
+#ifndef OSE_LINED_FORMATMAXDEPTH
+#define OSE_LINED_FORMATMAXDEPTH 0
+#endif
+/* size of the buffer /lined/format writes its output through */
+#ifndef OSE_LINED_FORMATCHUNK
+#define OSE_LINED_FORMATCHUNK 4096
+#endif
 #define OSE_LINED_PROMPTSTRING "/ "
 #define OSE_LINED_WORDBREAKCHARS "/"
 
 #define OSE_LINED_MAX_NUM_CHARS 4
 
-static void ose_lined_prompt(ose_bundle osevm);
+/* max number of entries in the history */
+#define OSE_LINED_HISTMAX 128
+/* bytes available for history entries */
+#define OSE_LINED_HISTDATASIZE 6144
+
+/* max number of entries in the kill ring */
+#define OSE_LINED_KILLMAX 32
+/* bytes available for killed text */
+#define OSE_LINED_KILLDATASIZE 7168
+
+/* what the previous key did, for merging kills and M-y */
+#define CMD_NONE 0
+#define CMD_KILL 1
+#define CMD_YANK 2
+#define CMD_INSERT 3
+
+/* 
+   Built-in actions a key can be bound to in /lo/kt and /lo/km.
+   ACT_BINDING queues the user binding /lined/binding/<key name>.
+*/
+#define ACT_NONE 0
+#define ACT_INSERT 1
+#define ACT_BINDING 2
+#define ACT_BOL 3
+#define ACT_EOL 4
+#define ACT_BACKCHAR 5
+#define ACT_FWDCHAR 6
+#define ACT_BACKWORD 7
+#define ACT_FWDWORD 8
+#define ACT_DELCHAR 9
+#define ACT_BACKDELCHAR 10
+#define ACT_KILLLINE 11
+#define ACT_KILLWORD 12
+#define ACT_BACKKILLWORD 13
+#define ACT_YANK 14
+#define ACT_YANKPOP 15
+#define ACT_PREVHIST 16
+#define ACT_NEXTHIST 17
+#define ACT_SEARCH 18
+#define ACT_COMPLETE 19
+#define ACT_ACCEPT 20
+#define ACT_UNDO 21
+#define ACT_REDO 22
+#define NACTIONS 23
 
-static int addchar(ose_bundle vm_le, int32_t c)
+#ifdef OSE_LINED_STATS
+/*
+  Counters and latency histograms, kept when the module is built
+  with OSE_LINED_STATS and pushed by /lined/stats. Counters wrap at
+  2^32. Bucket i of a histogram counts the calls that took from 2^i
+  to 2^(i+1) - 1 ticks of the cycle counter (ns on targets without
+  one).
+*/
+#define STATS_NBUCKETS 32
+
+static struct
 {
-    int32_t bufsize = ose_readInt32(vm_le, BUFSIZE_OFFSET);
-    int32_t buflen = ose_readInt32(vm_le, BUFLEN_OFFSET);
-    int32_t curpos = ose_readInt32(vm_le, CURPOS_OFFSET);
-    if(buflen < bufsize)
-    {
-        if(buflen == curpos)
-        {
-            ose_writeByte(vm_le, BUF_OFFSET + buflen, c);
-            ++buflen;
-            ++curpos;
-        }
-        else
-        {
-            char *p = ose_getBundlePtr(vm_le) + BUF_OFFSET;
-            memmove(p + curpos + 1, p + curpos, buflen - curpos);
-            ose_writeByte(vm_le, BUF_OFFSET + curpos, c);
-            ++buflen;
-            ++curpos;
-        }
-    }
-    ose_writeInt32(vm_le, BUFLEN_OFFSET, buflen);
-    ose_writeInt32(vm_le, CURPOS_OFFSET, curpos);
-    return 1;
+    /* keys, by the action they're bound to */
+    uint32_t actions[NACTIONS];
+    /* bytes pasted, and bytes the input decoder swallowed */
+    uint32_t pastebytes;
+    uint32_t swallowed;
+    uint32_t renders;
+    /* bytes /lined/print produced */
+    uint32_t bytes;
+    uint32_t histlookups;
+    uint32_t histevictions;
+    uint32_t charticks[STATS_NBUCKETS];
+    uint32_t printticks[STATS_NBUCKETS];
+} stats;
+
+static uint64_t statticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
 }
 
-static void delchar(ose_bundle vm_le)
+static void stathist(uint32_t *hist, uint64_t ticks)
 {
-    int32_t buflen = ose_readInt32(vm_le, BUFLEN_OFFSET);
-    int32_t curpos = ose_readInt32(vm_le, CURPOS_OFFSET);
-    if(curpos > 0)
+    int32_t i = 0;
+    while((ticks >>= 1) && i < STATS_NBUCKETS - 1)
     {
-        if(curpos == buflen)
-        {
-            --buflen;
-            --curpos;
-            ose_writeByte(vm_le, BUF_OFFSET + curpos, 0);
-        }
-        else
-        {
-            char *b = ose_getBundlePtr(vm_le) + BUF_OFFSET;
-            memmove(b + curpos - 1, b + curpos, buflen - curpos);
-            b[buflen - 1] = 0;
-            --buflen;
-            --curpos;
-        }
+        ++i;
     }
-    ose_writeInt32(vm_le, BUFLEN_OFFSET, buflen);
-    ose_writeInt32(vm_le, CURPOS_OFFSET, curpos);
+    ++hist[i];
 }
 
-static void clear(ose_bundle vm_le)
+#define STAT_ADD(field, n) (stats.field += (uint32_t)(n))
+#define STAT_START(t) const uint64_t t = statticks()
+#define STAT_END(hist, t) stathist(stats.hist, statticks() - (t))
+#else
+#define STAT_ADD(field, n)
+#define STAT_START(t)
+#define STAT_END(hist, t)
+#endif
+
+/*
+  Undo log size: max number of records, and bytes for their text.
+  An edit that doesn't fit on its own empties the log.
+*/
+#ifndef OSE_LINED_UNDOMAX
+#define OSE_LINED_UNDOMAX 128
+#endif
+#ifndef OSE_LINED_UNDODATASIZE
+#define OSE_LINED_UNDODATASIZE 4096
+#endif
+#define OSE_LINED_UNDOCONTEXTSIZE (OSE_LINED_UNDOMAX * 4        \
+                                   + OSE_LINED_UNDODATASIZE + 256)
+
+/* max number of line editor sessions, including session 0 */
+#ifndef OSE_LINED_MAXSESSIONS
+#define OSE_LINED_MAXSESSIONS 8
+#endif
+#define SESSION_INUSE 1
+/* the session uses the history of session 0 */
+#define SESSION_SHAREDHIST 2
+/* the contexts of the session exist, and /lh<n> if it has its own */
+#define SESSION_MADE 4
+#define SESSION_HASHIST 8
+
+/* max number of addresses TAB completes, and bytes for them */
+#ifndef OSE_LINED_COMPLETEMAX
+#define OSE_LINED_COMPLETEMAX 512
+#endif
+#ifndef OSE_LINED_COMPLETEDATASIZE
+#define OSE_LINED_COMPLETEDATASIZE 8192
+#endif
+
+#define UNDO_INS 1
+#define UNDO_DEL 2
+/* the cursor was after the deleted text */
+#define UNDO_BACK 4
+/* undone and redone together with the record before it */
+#define UNDO_JOIN 8
+
+#define OSE_LINED_SEARCHPROMPT "(reverse-i-search)`"
+#define OSE_LINED_SEARCHPROMPT_FAILED "(failed reverse-i-search)`"
+
+/* value of /rd's damage field when nothing needs to be redrawn */
+#define OSE_LINED_CLEAN 0x7fffffff
+
+/* sent by the terminal after a paste when bracketed paste is on */
+static const char pasteend[] = { ESC, '[', '2', '0', '1', '~' };
+#define PASTEEND_LEN 6
+
+/* key codes above 0xff: ESC followed by a byte */
+#define META(c) (0x100 | (c))
+
+/*
+  Input decoder. Each byte is mapped to a class, and the pair (state,
+  class) indexes a table that gives the action to take and the next
+  state. The state and the CSI parameter live in /le, so a sequence
+  that is split across calls to /lined/char picks up where it left
+  off.
+*/
+#define DEC_GROUND 0
+#define DEC_ESC 1
+#define DEC_CSI 2
+#define DEC_SS3 3
+/* bracketed paste, handled in bulk by paste() */
+#define DEC_PASTE 4
+
+#define CL_CTL 0 /* C0 controls other than ESC, and DEL */
+#define CL_ESC 1
+#define CL_INT 2 /* intermediates, 0x20-0x2f */
+#define CL_DIG 3 /* 0-9 */
+#define CL_SEP 4 /* other parameter bytes, 0x3a-0x3f */
+#define CL_LBR 5 /* [ */
+#define CL_SS3 6 /* O */
+#define CL_FIN 7 /* other final bytes, 0x40-0x7e */
+#define CL_HI 8 /* 0x80-0xff */
+#define NCLASSES 9
+
+#define A_NONE 0 /* swallow the byte */
+#define A_KEY 1 /* the byte is a key */
+#define A_META 2 /* ESC + the byte is a key */
+#define A_CLR 3 /* start of a CSI sequence */
+#define A_DIG 4 /* CSI parameter digit */
+#define A_SEP 5 /* CSI parameter separator */
+#define A_CSI 6 /* CSI final byte */
+#define A_SS3 7 /* SS3 final byte */
+
+#define T(action, state) (((action) << 4) | (state))
+
+static const unsigned char byteclass[256] =
 {
-    char *b = ose_getBundlePtr(vm_le);
-    memset(b + BUF_OFFSET, 0, OSE_LINED_BUFSIZE);
-    ose_writeInt32(vm_le, BUFLEN_OFFSET, 0);
-    ose_writeInt32(vm_le, CURPOS_OFFSET, 0);
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 6,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 5, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+    8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+};
+
+static const unsigned char transitions[4][NCLASSES] =
+{
+    /* DEC_GROUND */
+    {
+        T(A_KEY, DEC_GROUND), T(A_NONE, DEC_ESC),
+        T(A_KEY, DEC_GROUND), T(A_KEY, DEC_GROUND),
+        T(A_KEY, DEC_GROUND), T(A_KEY, DEC_GROUND),
+        T(A_KEY, DEC_GROUND), T(A_KEY, DEC_GROUND),
+        T(A_KEY, DEC_GROUND)
+    },
+    /* DEC_ESC */
+    {
+        T(A_META, DEC_GROUND), T(A_NONE, DEC_ESC),
+        T(A_META, DEC_GROUND), T(A_META, DEC_GROUND),
+        T(A_META, DEC_GROUND), T(A_CLR, DEC_CSI),
+        T(A_NONE, DEC_SS3), T(A_META, DEC_GROUND),
+        T(A_META, DEC_GROUND)
+    },
+    /* DEC_CSI */
+    {
+        T(A_KEY, DEC_CSI), T(A_NONE, DEC_ESC),
+        T(A_NONE, DEC_CSI), T(A_DIG, DEC_CSI),
+        T(A_SEP, DEC_CSI), T(A_CSI, DEC_GROUND),
+        T(A_CSI, DEC_GROUND), T(A_CSI, DEC_GROUND),
+        T(A_NONE, DEC_GROUND)
+    },
+    /* DEC_SS3 */
+    {
+        T(A_KEY, DEC_GROUND), T(A_NONE, DEC_ESC),
+        T(A_NONE, DEC_GROUND), T(A_NONE, DEC_SS3),
+        T(A_NONE, DEC_SS3), T(A_SS3, DEC_GROUND),
+        T(A_SS3, DEC_GROUND), T(A_SS3, DEC_GROUND),
+        T(A_NONE, DEC_GROUND)
+    },
+};
+
+/* 
+   once a parameter separator has been seen, further digits are
+   ignored: we only care about the first parameter
+*/
+#define PARAM_DONE 0x10000
+#define PARAM_MAX 10000
+
+/* keys for CSI / SS3 finals A through H: arrows, home, end */
+static const int32_t finalkeys[8] =
+{
+    CTRL('p'), CTRL('n'), CTRL('f'), CTRL('b'),
+    -1, CTRL('e'), -1, CTRL('a')
+};
+
+/* keys for CSI n ~ */
+static const int32_t tildekeys[9] =
+{
+    -1, CTRL('a'), -1, CTRL('d'), CTRL('e'), -1, -1, CTRL('a'), CTRL('e')
+};
+
+/* default key bindings; keys not listed insert themselves */
+static const int32_t defaultkeys[][2] =
+{
+    { CTRL('a'), ACT_BOL },
+    { CTRL('b'), ACT_BACKCHAR },
+    { CTRL('c'), ACT_BINDING },
+    { CTRL('d'), ACT_DELCHAR },
+    { CTRL('e'), ACT_EOL },
+    { CTRL('f'), ACT_FWDCHAR },
+    { CTRL('i'), ACT_COMPLETE },
+    { CTRL('k'), ACT_KILLLINE },
+    { CTRL('n'), ACT_NEXTHIST },
+    { CTRL('p'), ACT_PREVHIST },
+    { CTRL('r'), ACT_SEARCH },
+    { CTRL('y'), ACT_YANK },
+    { CTRL('_'), ACT_UNDO },
+    { LF, ACT_ACCEPT },
+    { RET, ACT_ACCEPT },
+    { BS, ACT_BACKDELCHAR },
+    { DEL, ACT_BACKDELCHAR },
+    { META('b'), ACT_BACKWORD },
+    { META('d'), ACT_KILLWORD },
+    { META('f'), ACT_FWDWORD },
+    { META('y'), ACT_YANKPOP },
+    { META('_'), ACT_REDO },
+    { META(CTRL('_')), ACT_REDO },
+    { META(BS), ACT_BACKKILLWORD },
+    { META(DEL), ACT_BACKKILLWORD },
+};
+
+/* names of the ACT_ actions, for /lined/key/bind */
+static const char * const actionnames[NACTIONS] =
+{
+    "none", "insert", "binding",
+    "beginning-of-line", "end-of-line",
+    "backward-char", "forward-char",
+    "backward-word", "forward-word",
+    "delete-char", "backward-delete-char",
+    "kill-line", "kill-word", "backward-kill-word",
+    "yank", "yank-pop",
+    "previous-history", "next-history", "reverse-search-history",
+    "complete", "accept-line", "undo", "redo",
+};
+
+/* fills the key dispatch tables in /lo in with the default bindings */
+static void initkeys(ose_bundle vm_lo)
+{
+    char * const b = ose_getBundlePtr(vm_lo);
+    size_t i;
+    memset(b + KEYTABLE_OFFSET, ACT_INSERT, 256);
+    memset(b + METATABLE_OFFSET, ACT_NONE, 256);
+    for(i = 0; i < sizeof(defaultkeys) / sizeof(defaultkeys[0]); i++)
+    {
+        const int32_t c = defaultkeys[i][0];
+        b[(c < META(0) ? KEYTABLE_OFFSET : METATABLE_OFFSET) + (c & 0xff)]
+            = defaultkeys[i][1];
+    }
 }
 
-static void inccurpos(ose_bundle vm_le)
+/*
+  Writes the name of key c, as used in /lined/binding/<name>: RET,
+  TAB, ESC, SPC and DEL; C^x for other control keys; 0xNN for bytes
+  above 0x7f; the char itself otherwise. Keys after ESC are prefixed
+  with M-. At most 7 bytes are written, including the null.
+*/
+static void keyname(char *name, int32_t c)
 {
-    int32_t bufsize = ose_readInt32(vm_le, BUFSIZE_OFFSET);
-    int32_t buflen = ose_readInt32(vm_le, BUFLEN_OFFSET);
-    int32_t curpos = ose_readInt32(vm_le, CURPOS_OFFSET);
-    if(curpos < buflen && curpos < bufsize)
+    static const char hex[] = "0123456789abcdef";
+    if(c >= META(0))
+    {
+        *name++ = 'M';
+        *name++ = '-';
+        c &= 0xff;
+    }
+    switch(c)
+    {
+    case RET:
+        strcpy(name, "RET");
+        return;
+    case CTRL('i'):
+        strcpy(name, "TAB");
+        return;
+    case ESC:
+        strcpy(name, "ESC");
+        return;
+    case SPC:
+        strcpy(name, "SPC");
+        return;
+    case DEL:
+        strcpy(name, "DEL");
+        return;
+    }
+    if(c < SPC)
+    {
+        *name++ = 'C';
+        *name++ = '^';
+        *name++ = c >= 1 && c <= 26 ? c + 0x60 : c + 0x40;
+    }
+    else if(c > DEL)
+    {
+        *name++ = '0';
+        *name++ = 'x';
+        *name++ = hex[c >> 4];
+        *name++ = hex[c & 0xf];
+    }
+    else
     {
-        ++curpos;
+        *name++ = c;
     }
-    ose_writeInt32(vm_le, CURPOS_OFFSET, curpos);
+    *name = 0;
 }
 
-static void deccurpos(ose_bundle vm_le)
+static void ose_lined_prompt(ose_bundle osevm);
+
+/*
+  Native copy of the /le state that every key touches. The entry
+  points load it once, work on it, and store it back to /le before
+  they return, so /le is current whenever anything else reads it.
+*/
+struct lined
+{
+    /* the edit buffer: bf, or the heap buffer */
+    char *buf;
+    char *bf;
+    int32_t bufsize;
+    int32_t buflen;
+    int32_t curpos;
+    /* display columns of the text before the cursor, and of the line */
+    int32_t curcol;
+    int32_t cols;
+    int32_t dirty;
+    int32_t instate;
+    int32_t inparam;
+    int32_t pastematch;
+    int32_t search;
+    /* from /lo */
+    int32_t promptlen;
+    int32_t bufmax;
+    const char *wbcs;
+    int32_t nwbcs;
+    /* wbcs compiled, in /le */
+    const unsigned char *wbmap;
+    int32_t lastcmd;
+    int32_t yanklen;
+};
+
+/*
+  Each session is a line editor with contexts of its own. Session 0
+  is /le, /lo, /lh, /lk and /lu; session n, made by
+  /lined/session/new, is /le<n>, /lo<n>, and so on, and may use the
+  history of session 0 instead of its own. The state of each session
+  is a byte in /ls (SESSION_ flags).
+*/
+struct session
 {
-    int32_t curpos = ose_readInt32(vm_le, CURPOS_OFFSET);
-    if(curpos > 0)
+    ose_bundle le, lo, lh, lk, lu;
+};
+
+/*
+  The contexts are looked up by name once per VM, and for other
+  sessions the first time they're used. They don't move afterwards.
+*/
+static char *cachedvm;
+static struct session sessions[OSE_LINED_MAXSESSIONS];
+static ose_bundle cachedls;
+static ose_bundle cachedlc;
+/* the session the primitives work on */
+static struct session *cur = sessions;
+/* 
+   id of the session a /lined/session/ primitive is working on, or -1
+   if a primitive without a session id is running
+*/
+static int32_t curid = -1;
+
+/* writes the name of the context base (e.g. "/le") for session id */
+static void sessionname(char *name, const char *base, int32_t id)
+{
+    char digits[12];
+    int32_t nd = 0;
+    while(*base)
+    {
+        *name++ = *base++;
+    }
+    while(id > 0)
     {
-        --curpos;
+        digits[nd++] = '0' + (id % 10);
+        id /= 10;
     }
-    ose_writeInt32(vm_le, CURPOS_OFFSET, curpos);
+    while(nd > 0)
+    {
+        *name++ = digits[--nd];
+    }
+    *name = 0;
 }
 
-static void pushline(ose_bundle osevm,
-                     const char * const line,
-                     int32_t oldlen,
-                     int32_t newlen,
-                     int32_t curpos)
+static ose_bundle entersession(ose_bundle osevm, const char *base,
+                               int32_t id)
 {
-    ose_bundle vm_s = OSEVM_STACK(osevm);
-    ose_pushString(vm_s, line);
-    ose_pushInt32(vm_s, oldlen);
-    ose_pushInt32(vm_s, newlen);
-    ose_pushInt32(vm_s, curpos);
+    char name[16];
+    ose_bundle b;
+    sessionname(name, base, id);
+    b = ose_enter(osevm, name);
+    ose_assert(ose_getBundlePtr(b));
+    return b;
 }
 
-static void setposvars(ose_bundle vm_le,
-                       int32_t bufsize,
-                       int32_t buflen,
-                       int32_t curpos)
+static void resolve(ose_bundle osevm)
 {
-    ose_writeInt32(vm_le, BUFSIZE_OFFSET, bufsize);
-    ose_writeInt32(vm_le, BUFLEN_OFFSET, buflen);
-    ose_writeInt32(vm_le, CURPOS_OFFSET, curpos);
+    if(ose_getBundlePtr(osevm) != cachedvm)
+    {
+        memset(sessions, 0, sizeof(sessions));
+        cachedls = ose_enter(osevm, "/ls");
+        ose_assert(ose_getBundlePtr(cachedls));
+        cachedlc = ose_enter(osevm, "/lc");
+        ose_assert(ose_getBundlePtr(cachedlc));
+        sessions[0].le = entersession(osevm, "/le", 0);
+        sessions[0].lo = entersession(osevm, "/lo", 0);
+        sessions[0].lh = entersession(osevm, "/lh", 0);
+        sessions[0].lk = entersession(osevm, "/lk", 0);
+        sessions[0].lu = entersession(osevm, "/lu", 0);
+        cur = sessions;
+        cachedvm = ose_getBundlePtr(osevm);
+    }
 }
 
-static const char *gethistitem(ose_bundle vm_lh)
+/* returns session id, or NULL if it isn't in use */
+static struct session *getsession(ose_bundle osevm, int32_t id)
 {
-    const int32_t histnum =
-        ose_readInt32(vm_lh, ose_getLastBundleElemOffset(vm_lh) + 16);
-    int32_t o = OSE_BUNDLE_HEADER_LEN;
-    const int32_t s = ose_readInt32(vm_lh, o);
-    int32_t i;
-    o += 4 + OSE_BUNDLE_HEADER_LEN;
-    if(histnum < 0)
+    struct session *s;
+    int32_t state;
+    if(id < 0 || id >= OSE_LINED_MAXSESSIONS)
     {
         return NULL;
     }
-
-    for(i = 0;
-        i < histnum && (o - (OSE_BUNDLE_HEADER_LEN + 4)) < s;
-        ++i, o += ose_readInt32(vm_lh, o) + 4)
+    state = ose_getBundlePtr(cachedls)[SESSIONSTATE_OFFSET + id];
+    if(!(state & SESSION_INUSE))
     {
-        ;
+        return NULL;
     }
+    s = sessions + id;
+    if(!ose_getBundlePtr(s->le))
     {
-        const char *p = ose_getBundlePtr(vm_lh) + o + 12;
-        return p;
+        s->le = entersession(osevm, "/le", id);
+        s->lo = entersession(osevm, "/lo", id);
+        s->lh = entersession(osevm, "/lh",
+                             (state & SESSION_SHAREDHIST) ? 0 : id);
+        s->lk = entersession(osevm, "/lk", id);
+        s->lu = entersession(osevm, "/lu", id);
     }
+    return s;
 }
 
-static void inchistnum(ose_bundle vm_lh)
+/*
+  Bindings run for a session keyed by id find the id on top of the
+  stack, so that they can pass it on to /lined/session/ primitives.
+*/
+static void pushsessionid(ose_bundle vm_s)
 {
-    const int32_t o = ose_getLastBundleElemOffset(vm_lh) + 12;
-    ose_assert(o > OSE_BUNDLE_HEADER_LEN);
-    ose_assert(o < ose_readSize(vm_lh));
+    if(curid >= 0)
     {
-        const int32_t histcount = ose_readInt32(vm_lh, o);
-        const int32_t histnum = ose_readInt32(vm_lh, o + 4);
-        ose_assert(histcount >= 0);
-        ose_assert(histnum < histcount);
-        if(histnum + 1 < histcount)
-        {
-            ose_writeInt32(vm_lh, o + 4,
-                           ose_readInt32(vm_lh, o + 4) + 1);
-        }
+        ose_pushInt32(vm_s, curid);
     }
 }
 
-static void dechistnum(ose_bundle vm_lh)
+static char *heapbuf(ose_bundle vm_le)
 {
-    const int32_t o = ose_getLastBundleElemOffset(vm_lh) + 12;
-    ose_assert(o > OSE_BUNDLE_HEADER_LEN);
-    ose_assert(o < ose_readSize(vm_lh));
+    char *p;
+    memcpy(&p, ose_getBundlePtr(vm_le) + HEAPBUF_OFFSET, sizeof(p));
+    return p;
+}
+
+static void setheapbuf(ose_bundle vm_le, char *p)
+{
+    memcpy(ose_getBundlePtr(vm_le) + HEAPBUF_OFFSET, &p, sizeof(p));
+}
+
+static void loadstate(struct lined *l, ose_bundle vm_le, ose_bundle vm_lo)
+{
+    char * const p = heapbuf(vm_le);
+    l->bf = ose_getBundlePtr(vm_le) + BUF_OFFSET;
+    l->buf = p ? p : l->bf;
+    l->bufsize = ose_readInt32(vm_le, BUFSIZE_OFFSET);
+    l->buflen = ose_readInt32(vm_le, BUFLEN_OFFSET);
+    l->curpos = ose_readInt32(vm_le, CURPOS_OFFSET);
+    l->curcol = ose_readInt32(vm_le, COLS_OFFSET);
+    l->cols = ose_readInt32(vm_le, LINECOLS_OFFSET);
+    l->dirty = ose_readInt32(vm_le, DIRTY_OFFSET);
+    l->instate = ose_readInt32(vm_le, INSTATE_OFFSET);
+    l->inparam = ose_readInt32(vm_le, INPARAM_OFFSET);
+    l->pastematch = ose_readInt32(vm_le, PASTEMATCH_OFFSET);
+    l->search = ose_readInt32(vm_le, SEARCH_OFFSET);
+    l->lastcmd = ose_readInt32(vm_le, LASTCMD_OFFSET);
+    l->yanklen = ose_readInt32(vm_le, YANKLEN_OFFSET);
+    l->promptlen = strlen(PROMPTSTRING);
+    l->bufmax = ose_readInt32(vm_lo, BUFMAX_OFFSET);
+    l->wbcs = WORDBREAKCHARS;
+    l->nwbcs = strlen(l->wbcs);
+    l->wbmap = (unsigned char *)ose_getBundlePtr(vm_le) + WBMAP_OFFSET;
     {
-        const int32_t histcount = ose_readInt32(vm_lh, o);
-        const int32_t histnum = ose_readInt32(vm_lh, o + 4);
-        ose_assert(histcount >= 0);
-        ose_assert(histnum < histcount);
-        if(histnum - 1 >= -1)
+        /* recompile the bitmap if /lo/wb has changed */
+        char * const src = ose_getBundlePtr(vm_le) + WBSRC_OFFSET;
+        if(l->nwbcs >= OSE_LINED_WBMAX || strcmp(src, l->wbcs))
         {
-            ose_writeInt32(vm_lh, o + 4,
-                           ose_readInt32(vm_lh, o + 4) - 1);
+            unsigned char * const map =
+                (unsigned char *)ose_getBundlePtr(vm_le) + WBMAP_OFFSET;
+            int32_t i;
+            memset(map, 0, 32);
+            for(i = 0; i < l->nwbcs; i++)
+            {
+                const unsigned char c = l->wbcs[i];
+                map[c >> 3] |= 1 << (c & 7);
+            }
+            if(l->nwbcs < OSE_LINED_WBMAX)
+            {
+                memcpy(src, l->wbcs, l->nwbcs + 1);
+            }
         }
     }
 }
 
-static void resethistnum(ose_bundle vm_lh)
+static void storestate(const struct lined *l, ose_bundle vm_le)
 {
-    const int32_t o = ose_getLastBundleElemOffset(vm_lh) + 12;
-    ose_assert(o > OSE_BUNDLE_HEADER_LEN);
-    ose_assert(o < ose_readSize(vm_lh));
-    ose_writeInt32(vm_lh, o + 4, -1);
+    setheapbuf(vm_le, l->buf == l->bf ? NULL : l->buf);
+    ose_writeInt32(vm_le, BUFSIZE_OFFSET, l->bufsize);
+    ose_writeInt32(vm_le, BUFLEN_OFFSET, l->buflen);
+    ose_writeInt32(vm_le, CURPOS_OFFSET, l->curpos);
+    ose_writeInt32(vm_le, COLS_OFFSET, l->curcol);
+    ose_writeInt32(vm_le, LINECOLS_OFFSET, l->cols);
+    ose_writeInt32(vm_le, DIRTY_OFFSET, l->dirty);
+    ose_writeInt32(vm_le, INSTATE_OFFSET, l->instate);
+    ose_writeInt32(vm_le, INPARAM_OFFSET, l->inparam);
+    ose_writeInt32(vm_le, PASTEMATCH_OFFSET, l->pastematch);
+    ose_writeInt32(vm_le, SEARCH_OFFSET, l->search);
+    ose_writeInt32(vm_le, LASTCMD_OFFSET, l->lastcmd);
+    ose_writeInt32(vm_le, YANKLEN_OFFSET, l->yanklen);
 }
 
-static int chariswbc(char c, int32_t nwbcs,
-                     const char * const wbcs)
+/*
+  Blocks of the line are loaded into vectors to look for word break
+  chars, and to skip over runs of ASCII when measuring text.
+*/
+#if defined(__AVX2__)
+#define WBVEC_LEN 32
+#define wbvec __m256i
+#define wbvec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define wbvec_match(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define wbvec_or _mm256_or_si256
+#define wbvec_zero _mm256_setzero_si256
+#define wbvec_mask(v) (uint32_t)_mm256_movemask_epi8(v)
+#elif defined(__SSE2__)
+#define WBVEC_LEN 16
+#define wbvec __m128i
+#define wbvec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define wbvec_match(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define wbvec_or _mm_or_si128
+#define wbvec_zero _mm_setzero_si128
+#define wbvec_mask(v) (uint32_t)_mm_movemask_epi8(v)
+#endif
+
+/* 
+   codepoints that take two columns (East Asian wide and fullwidth,
+   emoji), and none (combining marks, zero width spaces and joiners)
+*/
+static const uint32_t widecps[][2] =
+{
+    { 0x1100, 0x115f }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff },
+    { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+    { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe30, 0xfe4f },
+    { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x1f300, 0x1f64f },
+    { 0x1f900, 0x1f9ff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd }
+};
+
+static const uint32_t zerowidthcps[][2] =
+{
+    { 0x0300, 0x036f }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff },
+    { 0x200b, 0x200f }, { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+    { 0xfe20, 0xfe2f }
+};
+
+static int cpinranges(uint32_t cp, const uint32_t (*r)[2], int32_t n)
 {
     int32_t i;
-    for(i = 0; i < nwbcs; i++)
+    for(i = 0; i < n && cp >= r[i][0]; i++)
     {
-        if(c == wbcs[i])
+        if(cp <= r[i][1])
         {
             return 1;
         }
@@ -271,430 +976,3041 @@ static int chariswbc(char c, int32_t nwbcs,
     return 0;
 }
 
-static void ose_lined_char(ose_bundle osevm)
+static int32_t cpwidth(uint32_t cp)
 {
-    ose_bundle vm_le = ose_enter(osevm, "/le");
-    ose_assert(ose_getBundlePtr(vm_le));
-    ose_bundle vm_lo = ose_enter(osevm, "/lo");
-    ose_assert(ose_getBundlePtr(vm_lo));
-    ose_bundle vm_lh = ose_enter(osevm, "/lh");
-    ose_assert(ose_getBundlePtr(vm_lh));
-    ose_bundle vm_s = OSEVM_STACK(osevm);
-    ose_bundle vm_c = OSEVM_CONTROL(osevm);
-    ose_bundle vm_i = OSEVM_INPUT(osevm);
-    ose_assert(ose_bundleHasAtLeastNElems(vm_s, 1));
-    ose_assert(ose_peekType(vm_s) == OSETT_MESSAGE);
-    ose_assert(ose_peekMessageArgType(vm_s) == OSETT_INT32);
-    /* int32_t c = ose_popInt32(vm_s); */
-    char *b = ose_getBundlePtr(vm_le);
-    char *bufp = b + BUF_OFFSET;
-    int32_t bufsize = ose_readInt32(vm_le, BUFSIZE_OFFSET);
-    int32_t buflen = ose_readInt32(vm_le, BUFLEN_OFFSET);
-    int32_t curpos = ose_readInt32(vm_le, CURPOS_OFFSET);
-    int32_t promptlen = strlen(PROMPTSTRING);
-
-
-    int32_t numchars = 0;
-    if(ose_bundleHasAtLeastNElems(vm_s, 2)
-       && ose_peekType(vm_s) == OSETT_MESSAGE
-       && ose_peekMessageArgType(vm_s) == OSETT_INT32)
+    if(cp < 0x300)
     {
-        numchars = ose_popInt32(vm_s);
+        return 1;
     }
-    if(numchars == 0)
+    if(cpinranges(cp, zerowidthcps,
+                  sizeof(zerowidthcps) / sizeof(zerowidthcps[0])))
     {
-        return;
+        return 0;
+    }
+    if(cpinranges(cp, widecps, sizeof(widecps) / sizeof(widecps[0])))
+    {
+        return 2;
     }
-    ose_assert(ose_bundleHasAtLeastNElems(vm_s, numchars));
+    return 1;
+}
 
-    int32_t i = 0;
-    while(i < numchars)
+#define ISCONT(c) (((unsigned char)(c) & 0xc0) == 0x80)
+
+/* length of the UTF-8 sequence that starts with c */
+static int32_t seqlen(unsigned char c)
+{
+    return c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+}
+
+/*
+  Returns the number of columns the n bytes at s take up on the
+  terminal. Incomplete or invalid sequences take one column, as the
+  terminal shows them as a replacement char, and stray continuation
+  bytes none. Runs of ASCII are skipped a vector at a time.
+*/
+static int32_t textwidth(const char *s, int32_t n)
+{
+    int32_t i = 0, w = 0;
+    while(i < n)
     {
-        if(ose_peekType(vm_s) != OSETT_MESSAGE
-           || ose_peekMessageArgType(vm_s) != OSETT_INT32)
+        const unsigned char c = s[i];
+        int32_t len, k;
+        uint32_t cp;
+#ifdef WBVEC_LEN
+        if(i + WBVEC_LEN <= n && !wbvec_mask(wbvec_load(s + i)))
         {
-            while(i < numchars)
-            {
-                ose_drop(vm_s);
-            }
-            pushline(osevm, bufp, buflen, buflen, curpos);
-            return;
+            w += WBVEC_LEN;
+            i += WBVEC_LEN;
+            continue;
         }
-        int32_t c = ose_popInt32(vm_s);
-        ++i;
-        switch(c)
+#endif
+        if(c < 0x80)
         {
-        case CTRL('a'):
+            ++w;
+            ++i;
+            continue;
+        }
+        if(ISCONT(c))
         {
-            /* jump to beginning of line (end of prompt) */
-            int32_t o = promptlen;
-            ose_writeInt32(vm_le, CURPOS_OFFSET, o);
-            pushline(osevm, b + BUF_OFFSET, buflen, buflen, o);
+            ++i;
+            continue;
         }
-        break;
-        case CTRL('b'):
-            /* move back one char */
-            if(ose_readInt32(vm_le, CURPOS_OFFSET) >
-               promptlen)
-            {
-                deccurpos(vm_le);
-                pushline(osevm, b + BUF_OFFSET, buflen, buflen,
-                         curpos - 1);
-            }
-            else
-            {
-                pushline(osevm, b + BUF_OFFSET, buflen, buflen,
-                         curpos);
-            }
-            break;
-        case CTRL('c'):
-            ose_pushString(vm_c, "/!/lined/binding/C^c");
-            ose_swap(vm_c);
-            pushline(osevm, bufp, buflen, buflen, curpos);
-            break;
-        case CTRL('d'):
-            /* delete char under cursor */
-            if(curpos < buflen)
-            {
-                inccurpos(vm_le);
-                delchar(vm_le);
-                pushline(osevm, bufp, buflen, buflen - 1, curpos);
-            }
-            else
-            {
-                pushline(osevm, bufp, buflen, buflen, curpos);
-            }
-            break;
-        case CTRL('e'):
-            /* jump to end of line */
-            ose_writeInt32(vm_le, CURPOS_OFFSET, buflen);
-            pushline(osevm, b + BUF_OFFSET, buflen, buflen, buflen);
-            break;
-        case CTRL('f'):
-            /* move forward one char */
-            inccurpos(vm_le);
-            pushline(osevm, b + BUF_OFFSET, buflen, buflen,
-                     curpos + 1);
-            break;
-        case CTRL('k'):
+        len = seqlen(c);
+        cp = c & (0x7f >> len);
+        for(k = 1; k < len && i + k < n && ISCONT(s[i + k]); k++)
         {
-            /* kill forward to end of line */
-            memset(bufp + curpos, 0, buflen - curpos);
-            ose_writeInt32(vm_le, BUFLEN_OFFSET, curpos);
-            pushline(osevm, bufp, buflen, curpos, curpos);
-            buflen = curpos;
-            resethistnum(vm_lh);
+            cp = (cp << 6) | (s[i + k] & 0x3f);
         }
-        break;
-        case CTRL('n'):
+        w += k == len ? cpwidth(cp) : 1;
+        i += k;
+    }
+    return w;
+}
+
+/*
+  Returns the length of the codepoint at byte i of the n bytes at s,
+  and sets *cw to its width, measured as textwidth does.
+*/
+static int32_t cpat(const char *s, int32_t i, int32_t n, int32_t *cw)
+{
+    const unsigned char c = s[i];
+    int32_t len = 1;
+    *cw = 1;
+    if(ISCONT(c))
+    {
+        *cw = 0;
+    }
+    else if(c >= 0x80)
+    {
+        const int32_t sl = seqlen(c);
+        uint32_t cp = c & (0x7f >> sl);
+        for(; len < sl && i + len < n && ISCONT(s[i + len]); len++)
         {
-            /* get next history item */
-            dechistnum(vm_lh);
-            const char * const p = gethistitem(vm_lh);
-            if(!p)
-            {
-                /* pushline(osevm, bufp, buflen, buflen, curpos); */
-                memset(bufp + promptlen, 0, buflen - promptlen);
-                ose_writeInt32(vm_le, BUFLEN_OFFSET, promptlen);
-                curpos = promptlen;
-                ose_writeInt32(vm_le, CURPOS_OFFSET, promptlen);
-                pushline(osevm, bufp, buflen, curpos, curpos);
-                buflen = curpos;
-                break;
+            cp = (cp << 6) | (s[i + len] & 0x3f);
+        }
+        *cw = len == sl ? cpwidth(cp) : 1;
+    }
+    return len;
+}
+
+/*
+  Returns the number of wide glyphs in /le/lp before column col of
+  the text.
+*/
+static int32_t padsbefore(ose_bundle vm_le, int32_t col)
+{
+    int32_t lo = 0, hi = ose_readInt32(vm_le, PADCOUNT_OFFSET);
+    while(lo < hi)
+    {
+        const int32_t mid = lo + (hi - lo) / 2;
+        if(ose_readInt32(vm_le, PADS_OFFSET + mid * 4) < col)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+  Lays out the n bytes at s, which start at column col of the text,
+  on a terminal width columns wide. A wide glyph that would start in
+  the last column of a row is put at the start of the next row by
+  the terminal, which leaves the last column blank; each one is added
+  to /le/lp, which has to hold the ones before col already. Returns
+  the column of the wrapped line the bytes reach, which counts the
+  blank columns.
+*/
+static int32_t layoutpads(ose_bundle vm_le, const char *s, int32_t n,
+                          int32_t col, int32_t width)
+{
+    int32_t np = ose_readInt32(vm_le, PADCOUNT_OFFSET);
+    int32_t lcol = col + (np > 0 ? padsbefore(vm_le, col) : 0);
+    int32_t i = 0;
+    while(i < n)
+    {
+        int32_t len, cw;
+#ifdef WBVEC_LEN
+        if(i + WBVEC_LEN <= n && !wbvec_mask(wbvec_load(s + i)))
+        {
+            col += WBVEC_LEN;
+            lcol += WBVEC_LEN;
+            i += WBVEC_LEN;
+            continue;
+        }
+#endif
+        len = cpat(s, i, n, &cw);
+        if(cw == 2 && lcol % width == width - 1)
+        {
+            if(np >= 0 && np < OSE_LINED_MAXPADS)
+            {
+                ose_writeInt32(vm_le, PADS_OFFSET + np * 4, col);
+                ++np;
             }
-            int32_t len = strlen(p);
-            int32_t plen = ose_pnbytes(len);
-            if(len < buflen)
+            else
             {
-                memset(bufp + promptlen, 0, buflen - promptlen);
+                /* too many to keep: they'll be laid out again */
+                np = -1;
             }
-            memcpy(bufp + promptlen, p, plen);
-            len += promptlen;
-            pushline(osevm, bufp, len, len, len);
-            setposvars(vm_le, bufsize, len, len);
+            ++lcol;
         }
-        break;
-        case CTRL('p'):
+        col += cw;
+        lcol += cw;
+        i += len;
+    }
+    ose_writeInt32(vm_le, PADCOUNT_OFFSET, np);
+    return lcol;
+}
+
+/*
+  The cursor moves by codepoint: these return the start of the
+  codepoint before the cursor, and the end of the one after it. A
+  stray continuation byte counts as a codepoint of its own.
+*/
+static int32_t prevcp(const struct lined *l)
+{
+    const char * const bufp = l->buf;
+    const int32_t curpos = l->curpos;
+    int32_t k;
+    for(k = 1; k <= 4 && k <= curpos; k++)
+    {
+        const unsigned char c = bufp[curpos - k];
+        if(!ISCONT(c))
         {
-            /* get previous history item */
-            inchistnum(vm_lh);
-            const char * const p = gethistitem(vm_lh);
-            if(!p)
+            return k == 1 || seqlen(c) >= k ? curpos - k : curpos - 1;
+        }
+    }
+    return curpos - 1;
+}
+
+static int32_t nextcp(const struct lined *l)
+{
+    const char * const post =
+        l->buf + l->bufsize - 1 - (l->buflen - l->curpos);
+    const int32_t n = l->buflen - l->curpos;
+    int32_t k = 1;
+    if(n == 0)
+    {
+        return l->curpos;
+    }
+    if(!ISCONT(post[0]))
+    {
+        const int32_t len = seqlen(post[0]);
+        while(k < len && k < n && ISCONT(post[k]))
+        {
+            ++k;
+        }
+    }
+    return l->curpos + k;
+}
+
+static void damage(struct lined *l, int32_t pos)
+{
+    if(pos < l->dirty)
+    {
+        l->dirty = pos;
+    }
+}
+
+/*
+  The edit buffer is a gap buffer with the gap at the cursor: the text
+  before the cursor is at the start of the buffer, and the text after
+  it is at the end, followed by the null in the last byte, which is
+  never part of the gap. The line is only made contiguous when it's
+  pushed. The buffer starts out as /bf, and moves to the heap if the
+  line outgrows it; /bs is its size either way.
+*/
+static char *posttext(const struct lined *l)
+{
+    return l->buf + l->bufsize - 1 - (l->buflen - l->curpos);
+}
+
+/*
+  Doubles the size of the edit buffer, up to bufmax, moving it to the
+  heap if it's still in /bf. Returns 0 if it can't grow.
+*/
+static int growbuf(struct lined *l)
+{
+    /* the text after the gap, and the null */
+    const int32_t npost = l->buflen - l->curpos + 1;
+    char * const old = l->buf == l->bf ? NULL : l->buf;
+    int32_t newsize = l->bufsize * 2;
+    char *p;
+    if(newsize > l->bufmax)
+    {
+        newsize = l->bufmax;
+    }
+    if(newsize <= l->bufsize)
+    {
+        return 0;
+    }
+    p = realloc(old, newsize);
+    if(!p)
+    {
+        return 0;
+    }
+    if(old)
+    {
+        memmove(p + newsize - npost, p + l->bufsize - npost, npost);
+    }
+    else
+    {
+        memcpy(p, l->bf, l->curpos);
+        memcpy(p + newsize - npost, l->bf + l->bufsize - npost, npost);
+    }
+    l->buf = p;
+    l->bufsize = newsize;
+    return 1;
+}
+
+/* moves the cursor, and the gap with it, to pos */
+static void setcurpos(struct lined *l, int32_t pos)
+{
+    char * const post = posttext(l);
+    if(pos == l->buflen)
+    {
+        l->curcol = l->cols;
+    }
+    else if(pos < l->curpos)
+    {
+        l->curcol -= textwidth(l->buf + pos, l->curpos - pos);
+    }
+    else
+    {
+        l->curcol += textwidth(post, pos - l->curpos);
+    }
+    if(pos < l->curpos)
+    {
+        memmove(post - (l->curpos - pos), l->buf + pos, l->curpos - pos);
+    }
+    else if(pos > l->curpos)
+    {
+        memmove(l->buf + l->curpos, post, pos - l->curpos);
+    }
+    l->curpos = pos;
+}
+
+/*
+  Accounts for the bytes from from to the cursor having just been
+  inserted. If they continue a UTF-8 sequence before them, the
+  codepoint they complete is measured again and redrawn.
+*/
+static void inserted(struct lined *l, int32_t from)
+{
+    int32_t start = from, w;
+    while(start > 0 && start > from - 4 && ISCONT(l->buf[start]))
+    {
+        --start;
+    }
+    w = textwidth(l->buf + start, l->curpos - start)
+        - textwidth(l->buf + start, from - start);
+    l->curcol += w;
+    l->cols += w;
+    damage(l, start);
+}
+
+static int addchar(struct lined *l, int32_t c)
+{
+    if(l->buflen < l->bufsize - 1 || growbuf(l))
+    {
+        l->buf[l->curpos++] = c;
+        ++l->buflen;
+        inserted(l, l->curpos - 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* deletes the n bytes before the cursor: the gap takes them */
+static void delpre(struct lined *l, int32_t n)
+{
+    const int32_t w = textwidth(l->buf + l->curpos - n, n);
+    l->curpos -= n;
+    l->buflen -= n;
+    l->curcol -= w;
+    l->cols -= w;
+    damage(l, l->curpos);
+}
+
+/* deletes the n bytes after the cursor */
+static void delpost(struct lined *l, int32_t n)
+{
+    l->cols -= textwidth(posttext(l), n);
+    l->buflen -= n;
+    damage(l, l->curpos);
+}
+
+/*
+  Empties the line. Only the bytes the line took up in /bf are
+  zeroed, rather than all of it; the null at the end of the buffer
+  is never overwritten. What the terminal shows is left in /le/rd for
+  the frame pushed with the line, until /lined/prompt.
+*/
+static void clear(struct lined *l)
+{
+    if(l->buf != l->bf)
+    {
+        /* go back to /bf, which may still hold the start of the line */
+        free(l->buf);
+        l->buf = l->bf;
+        memset(l->bf, 0, OSE_LINED_BUFSIZE - 1);
+    }
+    else
+    {
+        memset(l->bf, 0, l->curpos);
+        memset(posttext(l), 0, l->buflen - l->curpos);
+    }
+    l->bufsize = OSE_LINED_BUFSIZE;
+    l->buflen = 0;
+    l->curpos = 0;
+    l->curcol = 0;
+    l->cols = 0;
+    l->dirty = 0;
+}
+
+static void inccurpos(struct lined *l)
+{
+    if(l->curpos < l->buflen)
+    {
+        setcurpos(l, nextcp(l));
+    }
+}
+
+static void deccurpos(struct lined *l)
+{
+    if(l->curpos > 0)
+    {
+        setcurpos(l, prevcp(l));
+    }
+}
+
+/*
+  Pushes the line from pos to the end as one string. The text before
+  the gap is null terminated in place for the copy, so the line is
+  materialized once, on the stack.
+*/
+static void pushtext(ose_bundle vm_s, const struct lined *l, int32_t pos)
+{
+    char * const bufp = l->buf;
+    const int32_t curpos = l->curpos;
+    const char * const post = posttext(l);
+    if(pos >= curpos)
+    {
+        ose_pushString(vm_s, post + (pos - curpos));
+        return;
+    }
+    {
+        /* the gap can be empty, in which case this is post[0] */
+        const char c = bufp[curpos];
+        bufp[curpos] = 0;
+        ose_pushString(vm_s, bufp + pos);
+        bufp[curpos] = c;
+    }
+    if(*post)
+    {
+        ose_pushString(vm_s, post);
+        ose_push(vm_s);
+        ose_concatenateStrings(vm_s);
+    }
+}
+
+/*
+  Pushes a render frame: the part of the line that changed since the
+  last frame (from the first damaged position to the end of the
+  line), followed by the width of the line as last pushed (oldlen),
+  the current width (newlen), and the cursor column, all in display
+  columns. The start of the changed span is newlen minus the width of
+  the string.
+  Frames are deltas against the previous frame, so every frame that
+  is pushed has to make it to /lined/print.
+*/
+static void pushline(ose_bundle osevm, ose_bundle vm_le, struct lined *l)
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    const int32_t buflen = l->buflen;
+    int32_t dirty = l->dirty;
+    if(dirty > buflen)
+    {
+        dirty = buflen;
+    }
+    pushtext(vm_s, l, dirty);
+    ose_pushInt32(vm_s, ose_readInt32(vm_le, TERMLEN_OFFSET));
+    ose_pushInt32(vm_s, l->cols);
+    ose_pushInt32(vm_s, l->curcol);
+    ose_writeInt32(vm_le, TERMLEN_OFFSET, l->cols);
+    l->dirty = OSE_LINED_CLEAN;
+}
+
+static int32_t ringnslots(ose_bundle b, int32_t o)
+{
+    return ose_readInt32(b, RING_INDEXSIZE(o)) / 4;
+}
+
+static int32_t ringdata(ose_bundle b, int32_t o)
+{
+    return RING_INDEX(o) + ringnslots(b, o) * 4 + 16;
+}
+
+/*
+  Returns the index slot of the entry that is age entries older than
+  the newest one, or -1 if there isn't one.
+*/
+static int32_t ringslot(ose_bundle b, int32_t o, int32_t age)
+{
+    const int32_t count = ose_readInt32(b, RING_COUNT(o));
+    if(age < 0 || age >= count)
+    {
+        return -1;
+    }
+    return (ose_readInt32(b, RING_FIRST(o)) + count - 1 - age)
+        % ringnslots(b, o);
+}
+
+/*
+  Returns the offset of the entry that is age entries older than the
+  newest one, or -1 if there isn't one.
+*/
+static int32_t ringget(ose_bundle b, int32_t o, int32_t age)
+{
+    const int32_t slot = ringslot(b, o, age);
+    if(slot < 0)
+    {
+        return -1;
+    }
+    return ringdata(b, o) + ose_readInt32(b, RING_INDEX(o) + slot * 4);
+}
+
+static void ringevict(ose_bundle b, int32_t o)
+{
+    const int32_t count = ose_readInt32(b, RING_COUNT(o));
+    if(count > 0)
+    {
+        const int32_t first = ose_readInt32(b, RING_FIRST(o));
+        ose_writeInt32(b, RING_FIRST(o), (first + 1) % ringnslots(b, o));
+        ose_writeInt32(b, RING_COUNT(o), count - 1);
+    }
+}
+
+/*
+  Reserves room for a new entry of len bytes at the head of the ring,
+  evicting the oldest entries until it fits, and writes its length
+  and terminating null. The caller copies the bytes. Returns the
+  offset of the entry, or -1 if it can't fit even in an empty ring.
+*/
+static int32_t ringalloc(ose_bundle b, int32_t o, int32_t len)
+{
+    const int32_t nslots = ringnslots(b, o);
+    const int32_t data = ringdata(b, o);
+    const int32_t datasize = ose_readInt32(b, data - 4);
+    const int32_t need = 4 + ose_pnbytes(len);
+    int32_t head = ose_readInt32(b, RING_HEAD(o));
+    int32_t count, pos;
+    if(need > datasize)
+    {
+        return -1;
+    }
+    while(ose_readInt32(b, RING_COUNT(o)) >= nslots)
+    {
+        ringevict(b, o);
+    }
+    for(;;)
+    {
+        int32_t tail;
+        count = ose_readInt32(b, RING_COUNT(o));
+        if(count == 0)
+        {
+            pos = 0;
+            break;
+        }
+        tail = ose_readInt32(b, RING_INDEX(o)
+                             + ose_readInt32(b, RING_FIRST(o)) * 4);
+        if(tail < head)
+        {
+            /* live entries are [tail, head) */
+            if(head + need <= datasize)
             {
-                pushline(osevm, bufp, buflen, buflen, curpos);
+                pos = head;
                 break;
             }
-            int32_t len = strlen(p);
-            int32_t plen = ose_pnbytes(len);
-            if(len < buflen)
+            if(need <= tail)
             {
-                memset(bufp + promptlen, 0, buflen - promptlen);
+                pos = 0;
+                break;
             }
-            memcpy(bufp + promptlen, p, plen);
-            len += promptlen;
-            pushline(osevm, bufp, len, len, len);
-            setposvars(vm_le, bufsize, len, len);
         }
-        break;
-        case LF:
-        case RET:
-            if(curpos == promptlen)
+        else if(head + need <= tail)
+        {
+            /* live entries wrap around: [tail, end) and [0, head) */
+            pos = head;
+            break;
+        }
+        ringevict(b, o);
+    }
+    {
+        const int32_t slot =
+            (ose_readInt32(b, RING_FIRST(o)) + count) % nslots;
+        ose_writeInt32(b, RING_INDEX(o) + slot * 4, pos);
+    }
+    ose_writeInt32(b, data + pos, len);
+    memset(ose_getBundlePtr(b) + data + pos + 4 + len, 0,
+           need - 4 - len);
+    ose_writeInt32(b, RING_COUNT(o), count + 1);
+    ose_writeInt32(b, RING_HEAD(o), pos + need);
+    return data + pos;
+}
+
+/*
+  Grows the newest entry by extra bytes, evicting the oldest entries
+  until it fits, and moving it to the start of the data if it can't
+  grow where it is. The caller fills in the new bytes. Returns the
+  offset of the entry, or -1 if it can't fit even on its own.
+*/
+static int32_t ringextend(ose_bundle b, int32_t o, int32_t extra)
+{
+    char * const bp = ose_getBundlePtr(b);
+    const int32_t data = ringdata(b, o);
+    const int32_t datasize = ose_readInt32(b, data - 4);
+    const int32_t slot = ringslot(b, o, 0);
+    int32_t pos, len, need;
+    if(slot < 0)
+    {
+        return -1;
+    }
+    pos = ose_readInt32(b, RING_INDEX(o) + slot * 4);
+    len = ose_readInt32(b, data + pos);
+    need = 4 + ose_pnbytes(len + extra);
+    if(need > datasize)
+    {
+        return -1;
+    }
+    for(;;)
+    {
+        const int32_t tail = ose_readInt32(b, RING_INDEX(o)
+                                           + ose_readInt32(b, RING_FIRST(o))
+                                           * 4);
+        if(ose_readInt32(b, RING_COUNT(o)) == 1)
+        {
+            if(pos + need > datasize)
             {
-                pushline(osevm, bufp, buflen, buflen, curpos);
-                break;
+                memmove(bp + data, bp + data + pos, 4 + len);
+                pos = 0;
             }
-            ose_pushString(vm_s, b + BUF_OFFSET + promptlen);
-            clear(vm_le);
-            ose_pushString(vm_c, "/!/lined/binding/RET");
-            ose_swap(vm_c);
-            resethistnum(vm_lh);
             break;
-        case BS:
-        case DEL:
-            if(ose_readInt32(vm_le, CURPOS_OFFSET) >
-               promptlen)
+        }
+        if(tail < pos)
+        {
+            /* the older entries are [tail, pos) */
+            if(pos + need <= datasize)
             {
-                delchar(vm_le);
-                pushline(osevm, b + BUF_OFFSET,
-                         buflen, buflen - 1, curpos - 1);
+                break;
             }
-            else
+            if(need <= tail)
             {
-                pushline(osevm, b + BUF_OFFSET,
-                         buflen, buflen, curpos);
+                memmove(bp + data, bp + data + pos, 4 + len);
+                pos = 0;
+                break;
             }
-            resethistnum(vm_lh);
+        }
+        else if(pos + need <= tail)
+        {
+            /* the older entries wrap around: [tail, end) and [0, pos) */
             break;
-        case ESC:
-            if(i < numchars
-               && ose_peekType(vm_s) == OSETT_MESSAGE
-               && ose_peekMessageArgType(vm_s) == OSETT_INT32)
-            {
-                const char ec = (char)ose_popInt32(vm_s);
-                const char * const wbcs = WORDBREAKCHARS;
-                const int32_t nwbcs = strlen(wbcs);
-                ++i;
-                switch(ec)
-                {
-                case 'b':
-                {
-                    /* jump back to prev word break char */
-                    if(chariswbc(bufp[curpos - 1], nwbcs, wbcs))
-                    {
-                        deccurpos(vm_le);
-                        --curpos;
-                    }
-                    
-                    while(!chariswbc(bufp[curpos - 1], nwbcs, wbcs)
-                          && curpos > promptlen)
-                    {
-                        deccurpos(vm_le);
-                        --curpos;
-                    }
-                    pushline(osevm, bufp, buflen, buflen,
-                             curpos);
-                }
-                break;
-                case 'd':
-                {
-                    /* delete from curpos to next word break char */
-                    int32_t i, j;
-                    for(i = curpos, j = 0; i < buflen; ++i, ++j)
-                    {
-                        if(chariswbc(bufp[i], nwbcs, wbcs))
-                        {
-                            break;
-                        }
-                    }
-                    int32_t n = buflen - curpos - j;
-                    memmove(bufp + curpos, bufp + curpos + j, n);
-                    memset(bufp + buflen - j, 0, j);
-                    ose_writeInt32(vm_le, BUFLEN_OFFSET, buflen - j);
-                    pushline(osevm, bufp, buflen, buflen - j,
-                             curpos);
-                    buflen -= j;
-                }
-                break;
-                case 'f':
-                {
-                    /* jump forward to next word break char */
-                    if(chariswbc(bufp[curpos], nwbcs, wbcs))
-                    {
-                        inccurpos(vm_le);
-                        ++curpos;
-                    }  
-                    while(!chariswbc(bufp[curpos], nwbcs, wbcs)
-                          && curpos <= buflen)
-                    {
-                        inccurpos(vm_le);
-                        ++curpos;
-                    }
-                    pushline(osevm, bufp, buflen, buflen,
-                             curpos);
-                }
-                break;
-                case BS:
-                case DEL:
+        }
+        ringevict(b, o);
+    }
+    ose_writeInt32(b, RING_INDEX(o) + slot * 4, pos);
+    ose_writeInt32(b, data + pos, len + extra);
+    memset(bp + data + pos + 4 + len + extra, 0, need - 4 - len - extra);
+    ose_writeInt32(b, RING_HEAD(o), pos + need);
+    return data + pos;
+}
+
+/* removes the n newest entries */
+static void ringdrop(ose_bundle b, int32_t o, int32_t n)
+{
+    const int32_t count = ose_readInt32(b, RING_COUNT(o)) - n;
+    int32_t head = 0;
+    ose_writeInt32(b, RING_COUNT(o), count);
+    if(count > 0)
+    {
+        const int32_t e = ringget(b, o, 0);
+        head = e - ringdata(b, o) + 4 + ose_pnbytes(ose_readInt32(b, e));
+    }
+    ose_writeInt32(b, RING_HEAD(o), head);
+}
+
+static const char *gethistitem(ose_bundle vm_lh)
+{
+    STAT_ADD(histlookups, 1);
+    const int32_t o = ringget(vm_lh, HISTCOUNT_OFFSET,
+                              ose_readInt32(vm_lh, HISTNUM_OFFSET));
+    if(o < 0)
+    {
+        return NULL;
+    }
+    return ose_getBundlePtr(vm_lh) + o + 4;
+}
+
+/*
+  Computes the signature of s: one bit per bigram, hashed into 128
+  bits. An entry can only contain a query if its signature has all of
+  the query's bits set.
+*/
+static void histsig(const char *s, int32_t n, uint32_t sig[4])
+{
+    int32_t i;
+    sig[0] = sig[1] = sig[2] = sig[3] = 0;
+    for(i = 1; i < n; i++)
+    {
+        const uint32_t h = ((unsigned char)s[i - 1] * 31u
+                            + (unsigned char)s[i]) & 127;
+        sig[h >> 5] |= 1u << (h & 31);
+    }
+}
+
+/*
+  Returns the age of the first history entry no newer than age that
+  contains the query, or -1. Entries whose signature rules them out
+  are skipped without looking at their bytes.
+*/
+static int32_t searchhist(ose_bundle vm_lh, const char * const q,
+                          int32_t qlen, int32_t age)
+{
+    const char * const lh = ose_getBundlePtr(vm_lh);
+    const int32_t count = ose_readInt32(vm_lh, HISTCOUNT_OFFSET);
+    uint32_t qsig[4];
+    histsig(q, qlen, qsig);
+    for(; age >= 0 && age < count; age++)
+    {
+        const int32_t slot = ringslot(vm_lh, HISTCOUNT_OFFSET, age);
+        const int32_t so = HISTSIG_OFFSET + slot * 16;
+        int32_t i;
+        for(i = 0; i < 4; i++)
+        {
+            const uint32_t sig = (uint32_t)ose_readInt32(vm_lh,
+                                                         so + i * 4);
+            if((sig & qsig[i]) != qsig[i])
+            {
+                break;
+            }
+        }
+        if(i == 4
+           && strstr(lh + ringget(vm_lh, HISTCOUNT_OFFSET, age) + 4, q))
+        {
+            return age;
+        }
+    }
+    return -1;
+}
+
+static void inchistnum(ose_bundle vm_lh)
+{
+    const int32_t o = HISTCOUNT_OFFSET;
+    ose_assert(o > OSE_BUNDLE_HEADER_LEN);
+    ose_assert(o < ose_readSize(vm_lh));
+    {
+        const int32_t histcount = ose_readInt32(vm_lh, o);
+        const int32_t histnum = ose_readInt32(vm_lh, o + 4);
+        ose_assert(histcount >= 0);
+        ose_assert(histnum < histcount);
+        if(histnum + 1 < histcount)
+        {
+            ose_writeInt32(vm_lh, o + 4,
+                           ose_readInt32(vm_lh, o + 4) + 1);
+        }
+    }
+}
+
+static void dechistnum(ose_bundle vm_lh)
+{
+    const int32_t o = HISTCOUNT_OFFSET;
+    ose_assert(o > OSE_BUNDLE_HEADER_LEN);
+    ose_assert(o < ose_readSize(vm_lh));
+    {
+        const int32_t histcount = ose_readInt32(vm_lh, o);
+        const int32_t histnum = ose_readInt32(vm_lh, o + 4);
+        ose_assert(histcount >= 0);
+        ose_assert(histnum < histcount);
+        if(histnum - 1 >= -1)
+        {
+            ose_writeInt32(vm_lh, o + 4,
+                           ose_readInt32(vm_lh, o + 4) - 1);
+        }
+    }
+}
+
+static void resethistnum(ose_bundle vm_lh)
+{
+    const int32_t o = HISTCOUNT_OFFSET;
+    ose_assert(o > OSE_BUNDLE_HEADER_LEN);
+    ose_assert(o < ose_readSize(vm_lh));
+    ose_writeInt32(vm_lh, o + 4, -1);
+}
+
+/*
+  Feeds one byte to the input decoder, and returns the key it
+  completes, or -1 if it's part of an unfinished (or unsupported)
+  sequence. CSI 200 ~ switches the decoder into DEC_PASTE if
+  bracketedpaste is set.
+*/
+static int32_t decode(struct lined *l, unsigned char c,
+                      int32_t bracketedpaste)
+{
+    const unsigned char t = transitions[l->instate][byteclass[c]];
+    int32_t key = -1;
+    l->instate = t & 0xf;
+    switch(t >> 4)
+    {
+    case A_NONE:
+        break;
+    case A_KEY:
+        key = c;
+        break;
+    case A_META:
+        key = META(c);
+        break;
+    case A_CLR:
+        l->inparam = 0;
+        break;
+    case A_DIG:
+        if(l->inparam < PARAM_MAX)
+        {
+            l->inparam = l->inparam * 10 + (c - '0');
+        }
+        break;
+    case A_SEP:
+        l->inparam |= PARAM_DONE;
+        break;
+    case A_CSI:
+    {
+        const int32_t param = l->inparam & ~PARAM_DONE;
+        if(c == '~')
+        {
+            if(param == 200 && bracketedpaste)
+            {
+                l->instate = DEC_PASTE;
+                l->pastematch = 0;
+            }
+            else if(param < 9)
+            {
+                key = tildekeys[param];
+            }
+        }
+        else if(c >= 'A' && c <= 'H')
+        {
+            key = finalkeys[c - 'A'];
+        }
+    }
+    break;
+    case A_SS3:
+        if(c >= 'A' && c <= 'H')
+        {
+            key = finalkeys[c - 'A'];
+        }
+        break;
+    }
+    return key;
+}
+
+/*
+  Writes c into the gap at pos, growing the buffer if the gap is
+  full. Returns the next position.
+*/
+static int32_t pastechar(struct lined *l, int32_t pos, char c)
+{
+    const int32_t n = pos - l->curpos;
+    if(l->buflen + n >= l->bufsize - 1)
+    {
+        int grew;
+        /* growbuf keeps the text before the gap, so count the paste */
+        l->buflen += n;
+        l->curpos += n;
+        grew = growbuf(l);
+        l->buflen -= n;
+        l->curpos -= n;
+        if(!grew)
+        {
+            return pos;
+        }
+    }
+    l->buf[pos] = c;
+    return pos + 1;
+}
+
+/*
+  Feeds one byte of a bracketed paste to the gap at *pos, holding
+  back bytes that might be the start of the end marker. Returns 1
+  when the end marker is complete.
+*/
+static int pastebyte(struct lined *l, int32_t *pos, int32_t *match, char c)
+{
+    if(c == pasteend[*match])
+    {
+        if(++*match == PASTEEND_LEN)
+        {
+            l->instate = DEC_GROUND;
+            *match = 0;
+            return 1;
+        }
+        return 0;
+    }
+    /* false alarm, the partial marker was part of the paste */
+    {
+        int32_t j;
+        for(j = 0; j < *match; j++)
+        {
+            *pos = pastechar(l, *pos, pasteend[j]);
+        }
+    }
+    *match = (c == pasteend[0]);
+    if(!*match)
+    {
+        *pos = pastechar(l, *pos, c);
+    }
+    return 0;
+}
+
+/* accounts for the bytes pasted into the gap up to pos */
+static void pasted(struct lined *l, int32_t pos, int32_t match)
+{
+    if(pos > l->curpos)
+    {
+        const int32_t from = l->curpos;
+        l->buflen += pos - from;
+        l->curpos = pos;
+        inserted(l, from);
+    }
+    l->pastematch = match;
+}
+
+/*
+  Inserts the bytes of a bracketed paste, taking them off the stack
+  until the end marker or the end of the batch, whichever comes
+  first. Everything, including control characters, goes into the
+  buffer literally. The gap is at the cursor, so the paste just fills
+  it. If the batch ends before the end marker, the decoder stays in
+  DEC_PASTE for the next call. Returns the updated batch index.
+*/
+static int32_t paste(struct lined *l, ose_bundle vm_s,
+                     int32_t i, int32_t numchars)
+{
+    int32_t match = l->pastematch;
+    int32_t pos = l->curpos;
+    while(i < numchars
+          && ose_peekType(vm_s) == OSETT_MESSAGE
+          && ose_peekMessageArgType(vm_s) == OSETT_INT32)
+    {
+        const char c = (char)ose_popInt32(vm_s);
+        ++i;
+        if(pastebyte(l, &pos, &match, c))
+        {
+            break;
+        }
+    }
+    pasted(l, pos, match);
+    return i;
+}
+
+/* paste() for a chunk of raw bytes, reading them in place */
+static int32_t pastechunk(struct lined *l, const unsigned char *chunk,
+                          int32_t i, int32_t numchars)
+{
+    int32_t match = l->pastematch;
+    int32_t pos = l->curpos;
+    while(i < numchars)
+    {
+        if(pastebyte(l, &pos, &match, (char)chunk[i++]))
+        {
+            break;
+        }
+    }
+    pasted(l, pos, match);
+    return i;
+}
+
+static int chariswbc(const struct lined *l, char c)
+{
+    const unsigned char u = c;
+    return (l->wbmap[u >> 3] >> (u & 7)) & 1;
+}
+
+/*
+  Word motions scan for the next or previous word break char in one
+  pass. When the set is small, the vector versions compare a block of
+  the line against each char in the set at once; otherwise, and for
+  what's left over, they fall back to the bitmap.
+*/
+#ifdef WBVEC_LEN
+/* one bit per byte of the block at p that is a word break char */
+static uint32_t wbvecscan(const struct lined *l, const char *p)
+{
+    const wbvec v = wbvec_load(p);
+    wbvec m = wbvec_zero();
+    int32_t k;
+    for(k = 0; k < l->nwbcs; k++)
+    {
+        m = wbvec_or(m, wbvec_match(v, l->wbcs[k]));
+    }
+    return wbvec_mask(m);
+}
+#endif
+
+/*
+  Returns the index of the first word break char in s[0, n), or n if
+  there isn't one.
+*/
+static int32_t scanwbfwd(const struct lined *l, const char *s, int32_t n)
+{
+    int32_t i = 0;
+#ifdef WBVEC_LEN
+    if(l->nwbcs <= OSE_LINED_WBSIMDMAX)
+    {
+        for(; i + WBVEC_LEN <= n; i += WBVEC_LEN)
+        {
+            const uint32_t bits = wbvecscan(l, s + i);
+            if(bits)
+            {
+                return i + __builtin_ctz(bits);
+            }
+        }
+    }
+#endif
+    for(; i < n; i++)
+    {
+        if(chariswbc(l, s[i]))
+        {
+            return i;
+        }
+    }
+    return n;
+}
+
+/*
+  Returns the index just past the last word break char in s[0, n),
+  or 0 if there isn't one.
+*/
+static int32_t scanwbback(const struct lined *l, const char *s, int32_t n)
+{
+#ifdef WBVEC_LEN
+    if(l->nwbcs <= OSE_LINED_WBSIMDMAX)
+    {
+        for(; n >= WBVEC_LEN; n -= WBVEC_LEN)
+        {
+            const uint32_t bits = wbvecscan(l, s + n - WBVEC_LEN);
+            if(bits)
+            {
+                return n - WBVEC_LEN + 32 - __builtin_clz(bits);
+            }
+        }
+    }
+#endif
+    for(; n > 0; n--)
+    {
+        if(chariswbc(l, s[n - 1]))
+        {
+            return n;
+        }
+    }
+    return 0;
+}
+
+/*
+  Returns the start of the word before the cursor, skipping a word
+  break char right before it: the target of M-b and M-DEL.
+*/
+static int32_t wordback(const struct lined *l)
+{
+    int32_t i = l->curpos;
+    if(i > l->promptlen && chariswbc(l, l->buf[i - 1]))
+    {
+        --i;
+    }
+    return l->promptlen
+        + scanwbback(l, l->buf + l->promptlen, i - l->promptlen);
+}
+
+/*
+  Saves n bytes of killed text in the kill ring. A kill right after
+  another one is merged into the same entry: appended, or prepended
+  if the text was killed backwards.
+*/
+static void savekill(struct lined *l, ose_bundle vm_lk,
+                     const char *s, int32_t n, int prepend)
+{
+    const int32_t o = KILLCOUNT_OFFSET;
+    char * const bp = ose_getBundlePtr(vm_lk);
+    if(l->lastcmd == CMD_KILL && ose_readInt32(vm_lk, RING_COUNT(o)) > 0)
+    {
+        const int32_t len = ose_readInt32(vm_lk, ringget(vm_lk, o, 0));
+        const int32_t e = ringextend(vm_lk, o, n);
+        if(e >= 0 && prepend)
+        {
+            memmove(bp + e + 4 + n, bp + e + 4, len);
+            memcpy(bp + e + 4, s, n);
+        }
+        else if(e >= 0)
+        {
+            memcpy(bp + e + 4 + len, s, n);
+        }
+    }
+    else if(n > 0)
+    {
+        const int32_t e = ringalloc(vm_lk, o, n);
+        if(e >= 0)
+        {
+            memcpy(bp + e + 4, s, n);
+        }
+    }
+    l->lastcmd = CMD_KILL;
+}
+
+/*
+  Inserts n bytes at the cursor, growing the buffer as needed.
+  Returns the number of bytes that fit.
+*/
+static int32_t inserttext(struct lined *l, const char *s, int32_t n)
+{
+    while(l->buflen + n > l->bufsize - 1 && growbuf(l))
+    {
+        ;
+    }
+    if(l->buflen + n > l->bufsize - 1)
+    {
+        n = l->bufsize - 1 - l->buflen;
+    }
+    memcpy(l->buf + l->curpos, s, n);
+    l->curpos += n;
+    l->buflen += n;
+    inserted(l, l->curpos - n);
+    return n;
+}
+
+/*
+  Inserts the kill ring entry that is age entries older than the
+  newest one at the cursor, copying it straight out of /lk into the
+  gap. Returns the number of bytes inserted.
+*/
+static int32_t yank(struct lined *l, ose_bundle vm_lk, int32_t age)
+{
+    const int32_t e = ringget(vm_lk, KILLCOUNT_OFFSET, age);
+    if(e < 0)
+    {
+        return 0;
+    }
+    return inserttext(l, ose_getBundlePtr(vm_lk) + e + 4,
+                      ose_readInt32(vm_lk, e));
+}
+
+static const char *completeentry(ose_bundle vm_lc, int32_t i)
+{
+    return ose_getBundlePtr(vm_lc) + COMPLETEDATA_OFFSET
+        + ose_readInt32(vm_lc, COMPLETEINDEX_OFFSET + i * 4);
+}
+
+/* compares the address e with the n bytes at s */
+static int completecmp(const char *e, const char *s, int32_t n)
+{
+    const int c = strncmp(e, s, n);
+    return c ? c : e[n] != 0;
+}
+
+/*
+  Returns the index of the first address that isn't less than the n
+  bytes at s, or, if prefix is set, that doesn't start with them.
+*/
+static int32_t completefind(ose_bundle vm_lc, const char *s, int32_t n,
+                            int32_t lo, int prefix)
+{
+    int32_t hi = ose_readInt32(vm_lc, COMPLETECOUNT_OFFSET);
+    while(lo < hi)
+    {
+        const int32_t mid = lo + (hi - lo) / 2;
+        const char * const e = completeentry(vm_lc, mid);
+        if(prefix ? !strncmp(e, s, n) : completecmp(e, s, n) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+  Adds the n byte address at s to the completion index, unless it's
+  there already. The index is kept sorted, so this moves the offsets
+  after it up by one. If the index is full, the address is left out,
+  and the index is rebuilt by the next completion.
+*/
+static void completeadd(ose_bundle vm_lc, const char *s, int32_t n)
+{
+    char * const b = ose_getBundlePtr(vm_lc);
+    const int32_t count = ose_readInt32(vm_lc, COMPLETECOUNT_OFFSET);
+    const int32_t head = ose_readInt32(vm_lc, COMPLETEHEAD_OFFSET);
+    const int32_t i = completefind(vm_lc, s, n, 0, 0);
+    if(i < count && !completecmp(completeentry(vm_lc, i), s, n))
+    {
+        return;
+    }
+    if(count == OSE_LINED_COMPLETEMAX
+       || head + n + 1 > OSE_LINED_COMPLETEDATASIZE)
+    {
+        ose_writeInt32(vm_lc, COMPLETEFULL_OFFSET, 1);
+        return;
+    }
+    memcpy(b + COMPLETEDATA_OFFSET + head, s, n);
+    b[COMPLETEDATA_OFFSET + head + n] = 0;
+    memmove(b + COMPLETEINDEX_OFFSET + (i + 1) * 4,
+            b + COMPLETEINDEX_OFFSET + i * 4,
+            (count - i) * 4);
+    ose_writeInt32(vm_lc, COMPLETEINDEX_OFFSET + i * 4, head);
+    ose_writeInt32(vm_lc, COMPLETECOUNT_OFFSET, count + 1);
+    ose_writeInt32(vm_lc, COMPLETEHEAD_OFFSET, head + n + 1);
+}
+
+/* adds the words in n bytes of text that start with a slash */
+static void completeaddtext(ose_bundle vm_lc, const char *s, int32_t n)
+{
+    int32_t i = 0;
+    while(i < n)
+    {
+        int32_t j = i;
+        while(j < n && (unsigned char)s[j] > SPC)
+        {
+            ++j;
+        }
+        if(j > i && s[i] == '/')
+        {
+            completeadd(vm_lc, s + i, j - i);
+        }
+        i = j + 1;
+    }
+}
+
+/* FNV-1a of the size and address of the env element at o */
+static uint32_t completehash(ose_bundle vm_e, int32_t o)
+{
+    const char *a = ose_getBundlePtr(vm_e) + o + 4;
+    uint32_t h = (2166136261u ^ (uint32_t)ose_readInt32(vm_e, o))
+        * 16777619u;
+    for(; *a; a++)
+    {
+        h = (h ^ (unsigned char)*a) * 16777619u;
+    }
+    return h;
+}
+
+/*
+  Adds the addresses of the env elements from offset o on to the
+  completion index, and remembers the last one.
+*/
+static void completeenvfrom(ose_bundle vm_lc, ose_bundle vm_e, int32_t o)
+{
+    const char * const b = ose_getBundlePtr(vm_e);
+    const int32_t size = ose_readSize(vm_e);
+    int32_t last = ose_readInt32(vm_lc, COMPLETELAST_OFFSET);
+    while(o < size)
+    {
+        const int32_t n = ose_readInt32(vm_e, o);
+        if(n <= 0 || o + 4 + n > size)
+        {
+            break;
+        }
+        if(b[o + 4] == '/')
+        {
+            completeadd(vm_lc, b + o + 4, strlen(b + o + 4));
+        }
+        last = o;
+        o += 4 + n;
+    }
+    ose_writeInt32(vm_lc, COMPLETEENV_OFFSET, o);
+    ose_writeInt32(vm_lc, COMPLETELAST_OFFSET, last);
+    ose_writeInt32(vm_lc, COMPLETEHASH_OFFSET,
+                   last ? (int32_t)completehash(vm_e, last) : 0);
+}
+
+/*
+  Empties the completion index and adds the addresses in the env and
+  then those in the history of each session back, newest first, so
+  that if they don't all fit, it's the oldest history that's left
+  out.
+*/
+static void completerebuild(ose_bundle osevm)
+{
+    ose_bundle vm_lc = cachedlc;
+    int32_t id;
+    ose_writeInt32(vm_lc, COMPLETECOUNT_OFFSET, 0);
+    ose_writeInt32(vm_lc, COMPLETEHEAD_OFFSET, 0);
+    ose_writeInt32(vm_lc, COMPLETELAST_OFFSET, 0);
+    completeenvfrom(vm_lc, OSEVM_ENV(osevm), OSE_BUNDLE_HEADER_LEN);
+    for(id = 0; id < OSE_LINED_MAXSESSIONS; id++)
+    {
+        const struct session * const s = getsession(osevm, id);
+        int32_t age, count;
+        if(!s || (ose_getBundlePtr(cachedls)[SESSIONSTATE_OFFSET + id]
+                  & SESSION_SHAREDHIST))
+        {
+            continue;
+        }
+        count = ose_readInt32(s->lh, RING_COUNT(HISTCOUNT_OFFSET));
+        for(age = 0; age < count; age++)
+        {
+            const int32_t e = ringget(s->lh, HISTCOUNT_OFFSET, age);
+            completeaddtext(vm_lc, ose_getBundlePtr(s->lh) + e + 4,
+                            ose_readInt32(s->lh, e));
+        }
+    }
+    ose_writeInt32(vm_lc, COMPLETEFULL_OFFSET, 0);
+}
+
+/*
+  Adds the addresses bound in the env since the last call to the
+  completion index. lined doesn't see bindings being made, but they
+  are appended to the env, so only the elements after the last one
+  indexed are walked. That element is checked first: if it has moved
+  or changed, the env has shrunk or been rearranged, and the index is
+  rebuilt, as it is if an address didn't fit in it.
+*/
+static void completeenv(ose_bundle osevm)
+{
+    ose_bundle vm_lc = cachedlc;
+    ose_bundle vm_e = OSEVM_ENV(osevm);
+    const int32_t o = ose_readInt32(vm_lc, COMPLETEENV_OFFSET);
+    const int32_t last = ose_readInt32(vm_lc, COMPLETELAST_OFFSET);
+    if(ose_readInt32(vm_lc, COMPLETEFULL_OFFSET)
+       || o > ose_readSize(vm_e)
+       || (last
+           && (last + 4 + ose_readInt32(vm_e, last) != o
+               || completehash(vm_e, last)
+               != (uint32_t)ose_readInt32(vm_lc, COMPLETEHASH_OFFSET))))
+    {
+        completerebuild(osevm);
+        return;
+    }
+    completeenvfrom(vm_lc, vm_e, o);
+}
+
+/*
+  Completes the address before the cursor, i.e., the text back to
+  the last space. The text that all of the matching addresses share
+  is inserted. If there's more than one, the index of the first and
+  the number of matches are stored in first and n. Returns the number
+  of bytes inserted.
+*/
+static int32_t complete(struct lined *l, ose_bundle osevm,
+                        int32_t *first, int32_t *n)
+{
+    ose_bundle vm_lc = cachedlc;
+    const char *s, *a, *z;
+    int32_t start = l->curpos, len, i, j, common;
+    while(start > l->promptlen
+          && (unsigned char)l->buf[start - 1] > SPC)
+    {
+        --start;
+    }
+    s = l->buf + start;
+    len = l->curpos - start;
+    completeenv(osevm);
+    i = completefind(vm_lc, s, len, 0, 0);
+    j = completefind(vm_lc, s, len, i, 1);
+    *n = 0;
+    if(i == j)
+    {
+        return 0;
+    }
+    a = completeentry(vm_lc, i);
+    z = completeentry(vm_lc, j - 1);
+    common = len;
+    while(a[common] && a[common] == z[common])
+    {
+        ++common;
+    }
+    /* don't split a character */
+    while(common > len && ISCONT(a[common]))
+    {
+        --common;
+    }
+    if(j - i > 1)
+    {
+        *first = i;
+        *n = j - i;
+    }
+    return common > len ? inserttext(l, a + len, common - len) : 0;
+}
+
+/* pushes n addresses from the completion index as a bundle */
+static void pushcompletions(ose_bundle vm_s, int32_t first, int32_t n)
+{
+    int32_t i;
+    ose_pushBundle(vm_s);
+    for(i = first; i < first + n; i++)
+    {
+        ose_pushString(vm_s, completeentry(cachedlc, i));
+        ose_push(vm_s);
+    }
+}
+
+/*
+  Records an edit in the undo log: n bytes at pos, s, were inserted
+  or deleted. Whatever was undone before it can't be redone anymore.
+  An insert is merged into the newest record if coalesce is set and
+  that record is an insert ending at pos.
+*/
+static void undorecord(ose_bundle vm_lu, int32_t kind, int32_t pos,
+                       const char *s, int32_t n, int coalesce)
+{
+    const int32_t o = UNDOCOUNT_OFFSET;
+    const int32_t undone = ose_readInt32(vm_lu, UNDONE_OFFSET);
+    int32_t e;
+    if(n <= 0)
+    {
+        return;
+    }
+    if(undone > 0)
+    {
+        ringdrop(vm_lu, o, undone);
+        ose_writeInt32(vm_lu, UNDONE_OFFSET, 0);
+        coalesce = 0;
+    }
+    e = ringget(vm_lu, o, 0);
+    if(coalesce && kind == UNDO_INS && e >= 0
+       && ose_readInt32(vm_lu, e + 8) == UNDO_INS
+       && ose_readInt32(vm_lu, e + 4) + ose_readInt32(vm_lu, e) - 8 == pos)
+    {
+        const int32_t len = ose_readInt32(vm_lu, e);
+        e = ringextend(vm_lu, o, n);
+        if(e >= 0)
+        {
+            memcpy(ose_getBundlePtr(vm_lu) + e + 4 + len, s, n);
+            return;
+        }
+    }
+    e = ringalloc(vm_lu, o, 8 + n);
+    if(e < 0)
+    {
+        /* nothing before this edit can be undone */
+        ringdrop(vm_lu, o, ose_readInt32(vm_lu, RING_COUNT(o)));
+        return;
+    }
+    ose_writeInt32(vm_lu, e + 4, pos);
+    ose_writeInt32(vm_lu, e + 8, kind);
+    memcpy(ose_getBundlePtr(vm_lu) + e + 12, s, n);
+}
+
+static void undoreset(ose_bundle vm_lu)
+{
+    const int32_t o = UNDOCOUNT_OFFSET;
+    ringdrop(vm_lu, o, ose_readInt32(vm_lu, RING_COUNT(o)));
+    ose_writeInt32(vm_lu, UNDONE_OFFSET, 0);
+}
+
+/*
+  Applies the record at e to the line, forwards (redo) or backwards
+  (undo). The gap is moved to the edit, so this costs the size of the
+  edit plus the distance from the cursor.
+*/
+static void undoapply(struct lined *l, ose_bundle vm_lu,
+                      int32_t e, int forwards)
+{
+    const int32_t pos = ose_readInt32(vm_lu, e + 4);
+    const int32_t kind = ose_readInt32(vm_lu, e + 8);
+    const int32_t n = ose_readInt32(vm_lu, e) - 8;
+    damage(l, pos);
+    if(((kind & UNDO_INS) != 0) == (forwards != 0))
+    {
+        setcurpos(l, pos);
+        inserttext(l, ose_getBundlePtr(vm_lu) + e + 12, n);
+        if(!forwards && !(kind & UNDO_BACK))
+        {
+            setcurpos(l, pos);
+        }
+    }
+    else
+    {
+        setcurpos(l, pos + n);
+        delpre(l, n);
+    }
+}
+
+/*
+  Undoes the newest record that hasn't been undone, and the ones
+  joined to it.
+*/
+static void undo(struct lined *l, ose_bundle vm_lu)
+{
+    int32_t undone = ose_readInt32(vm_lu, UNDONE_OFFSET);
+    int32_t e;
+    while((e = ringget(vm_lu, UNDOCOUNT_OFFSET, undone)) >= 0)
+    {
+        undoapply(l, vm_lu, e, 0);
+        ++undone;
+        if(!(ose_readInt32(vm_lu, e + 8) & UNDO_JOIN))
+        {
+            break;
+        }
+    }
+    ose_writeInt32(vm_lu, UNDONE_OFFSET, undone);
+}
+
+/* redoes the oldest undone record, and the ones joined to it */
+static void redo(struct lined *l, ose_bundle vm_lu)
+{
+    int32_t undone = ose_readInt32(vm_lu, UNDONE_OFFSET);
+    while(undone > 0)
+    {
+        int32_t e;
+        undoapply(l, vm_lu,
+                  ringget(vm_lu, UNDOCOUNT_OFFSET, --undone), 1);
+        e = ringget(vm_lu, UNDOCOUNT_OFFSET, undone - 1);
+        if(e < 0 || !(ose_readInt32(vm_lu, e + 8) & UNDO_JOIN))
+        {
+            break;
+        }
+    }
+    ose_writeInt32(vm_lu, UNDONE_OFFSET, undone);
+}
+
+/*
+  Replaces the line after the prompt with the history entry p, and
+  puts the cursor at pos within it.
+*/
+static void loadhist(struct lined *l, const char *p, int32_t pos)
+{
+    const int32_t promptlen = l->promptlen;
+    /* drop the old line, leaving the gap at the end of the prompt */
+    setcurpos(l, promptlen);
+    delpost(l, l->buflen - promptlen);
+    inserttext(l, p, strlen(p));
+    pos += promptlen;
+    setcurpos(l, pos < l->buflen ? pos : l->buflen);
+}
+
+/*
+  Ends a reverse search. If accept is set, the matching entry is
+  loaded into the line, and the history number is set to it so that
+  C^p/C^n continue from there.
+*/
+static void endsearch(struct lined *l, ose_bundle vm_le,
+                      ose_bundle vm_lh, int accept)
+{
+    const int32_t age = ose_readInt32(vm_le, SEARCHAGE_OFFSET);
+    if(accept && l->search == 1 && age >= 0)
+    {
+        const char * const q =
+            ose_getBundlePtr(vm_le) + SEARCHQUERY_OFFSET;
+        const char * const p = ose_getBundlePtr(vm_lh)
+            + ringget(vm_lh, HISTCOUNT_OFFSET, age) + 4;
+        loadhist(l, p, strstr(p, q) - p);
+        ose_writeInt32(vm_lh, HISTNUM_OFFSET, age);
+    }
+    l->search = 0;
+    /* the search line replaced the whole line on the terminal */
+    damage(l, 0);
+}
+
+/*
+  Runs the search for the current query starting at age, and records
+  the result.
+*/
+static void research(struct lined *l, ose_bundle vm_le,
+                     ose_bundle vm_lh, int32_t age)
+{
+    const char * const q = ose_getBundlePtr(vm_le) + SEARCHQUERY_OFFSET;
+    const int32_t qlen = ose_readInt32(vm_le, SEARCHLEN_OFFSET);
+    STAT_ADD(histlookups, 1);
+    const int32_t r = searchhist(vm_lh, q, qlen, age);
+    if(r >= 0)
+    {
+        ose_writeInt32(vm_le, SEARCHAGE_OFFSET, r);
+        l->search = 1;
+    }
+    else
+    {
+        l->search = 2;
+    }
+}
+
+/*
+  Handles a key during a reverse search. Returns -1 if the search
+  consumed the key, otherwise the search is accepted and the key is
+  returned to be handled as usual.
+*/
+static int32_t searchkey(struct lined *l, ose_bundle vm_le,
+                         ose_bundle vm_lh, int32_t c)
+{
+    char * const q = ose_getBundlePtr(vm_le) + SEARCHQUERY_OFFSET;
+    int32_t qlen = ose_readInt32(vm_le, SEARCHLEN_OFFSET);
+    const int32_t age = ose_readInt32(vm_le, SEARCHAGE_OFFSET);
+    switch(c)
+    {
+    case CTRL('r'):
+        /* next older match */
+        if(age >= 0)
+        {
+            research(l, vm_le, vm_lh, age + 1);
+        }
+        break;
+    case CTRL('g'):
+        endsearch(l, vm_le, vm_lh, 0);
+        break;
+    case BS:
+    case DEL:
+        if(qlen > 0)
+        {
+            q[--qlen] = 0;
+            ose_writeInt32(vm_le, SEARCHLEN_OFFSET, qlen);
+        }
+        research(l, vm_le, vm_lh, 0);
+        break;
+    default:
+        if(c < SPC || c >= META(0))
+        {
+            endsearch(l, vm_le, vm_lh, 1);
+            return c;
+        }
+        if(qlen < OSE_LINED_SEARCHMAX - 1)
+        {
+            q[qlen++] = c;
+            q[qlen] = 0;
+            ose_writeInt32(vm_le, SEARCHLEN_OFFSET, qlen);
+        }
+        research(l, vm_le, vm_lh, age < 0 ? 0 : age);
+        break;
+    }
+    return -1;
+}
+
+/*
+  Pushes a render frame showing the search: the search prompt, the
+  query, and the matching entry, with the cursor on the match. The
+  whole line is redrawn.
+*/
+static void pushsearch(ose_bundle osevm, struct lined *l,
+                       ose_bundle vm_le, ose_bundle vm_lh)
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    const char * const q = ose_getBundlePtr(vm_le) + SEARCHQUERY_OFFSET;
+    const int32_t qlen = ose_readInt32(vm_le, SEARCHLEN_OFFSET);
+    const int32_t age = ose_readInt32(vm_le, SEARCHAGE_OFFSET);
+    const char * const sp = l->search == 1
+        ? OSE_LINED_SEARCHPROMPT : OSE_LINED_SEARCHPROMPT_FAILED;
+    const int32_t o = ringget(vm_lh, HISTCOUNT_OFFSET, age);
+    const char * const p = o < 0 ? "" : ose_getBundlePtr(vm_lh) + o + 4;
+    const char * const m = strstr(p, q);
+    const int32_t start = strlen(sp) + textwidth(q, qlen) + 3;
+    const int32_t len = start + textwidth(p, strlen(p));
+    ose_pushString(vm_s, sp);
+    ose_pushString(vm_s, q);
+    ose_push(vm_s);
+    ose_concatenateStrings(vm_s);
+    ose_pushString(vm_s, "': ");
+    ose_push(vm_s);
+    ose_concatenateStrings(vm_s);
+    ose_pushString(vm_s, p);
+    ose_push(vm_s);
+    ose_concatenateStrings(vm_s);
+    ose_pushInt32(vm_s, ose_readInt32(vm_le, TERMLEN_OFFSET));
+    ose_pushInt32(vm_s, len);
+    ose_pushInt32(vm_s, m ? start + textwidth(p, m - p) : start);
+    ose_writeInt32(vm_le, TERMLEN_OFFSET, len);
+    l->dirty = 0;
+}
+
+/*
+  Applies every key in the batch to the edit buffer first, and then
+  pushes a single render frame for the whole batch, so that the cost
+  of a paste depends only on the number of bytes pasted.
+  The batch is either a count on top of that many ints, one per byte,
+  or a single blob or string of raw bytes, which are read where they
+  are and dropped at the end.
+  A batch stops at RET. What /lined/binding/RET finds on the stack,
+  from the bottom up, is: the keys after the RET, if there are any,
+  for the next call (the ints with their count on top of them, or the
+  bytes of a chunk as a blob or string like it); the frame for the
+  keys before the RET, with the cursor at the end of the line, which
+  is always there but has an empty span if nothing changed; and the
+  submitted line. The frame is printed before the newline, and
+  /lined/prompt starts the next line on a row of its own.
+*/
+static void ose_lined_char(ose_bundle osevm)
+{
+    STAT_START(t0);
+    resolve(osevm);
+    ose_bundle vm_le = cur->le;
+    ose_bundle vm_lo = cur->lo;
+    ose_bundle vm_lh = cur->lh;
+    ose_bundle vm_lk = cur->lk;
+    ose_bundle vm_lu = cur->lu;
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    ose_bundle vm_c = OSEVM_CONTROL(osevm);
+    ose_assert(ose_bundleHasAtLeastNElems(vm_s, 1));
+    ose_assert(ose_peekType(vm_s) == OSETT_MESSAGE);
+    char *b = ose_getBundlePtr(vm_le);
+    const int32_t bracketedpaste =
+        ose_readInt32(vm_lo, BRACKETEDPASTE_OFFSET);
+    struct lined l;
+
+    /* the raw bytes of a blob or string, or NULL for ints */
+    const unsigned char *chunk = NULL;
+    int32_t numchars = 0;
+    const char argtype = ose_peekMessageArgType(vm_s);
+    if(argtype == OSETT_BLOB)
+    {
+        const char * const p = ose_peekBlob(vm_s);
+        numchars = ose_readInt32(vm_s, p - ose_getBundlePtr(vm_s));
+        chunk = (const unsigned char *)p + 4;
+    }
+    else if(argtype == OSETT_STRING)
+    {
+        chunk = (const unsigned char *)ose_peekString(vm_s);
+        numchars = strlen((const char *)chunk);
+    }
+    else if(argtype == OSETT_INT32
+            && ose_bundleHasAtLeastNElems(vm_s, 2))
+    {
+        numchars = ose_popInt32(vm_s);
+    }
+    if(numchars == 0)
+    {
+        if(chunk)
+        {
+            ose_drop(vm_s);
+        }
+        return;
+    }
+    ose_assert(chunk || ose_bundleHasAtLeastNElems(vm_s, numchars));
+    loadstate(&l, vm_le, vm_lo);
+    const int32_t promptlen = l.promptlen;
+    const unsigned char * const keys =
+        (const unsigned char *)ose_getBundlePtr(vm_lo) + KEYTABLE_OFFSET;
+    const unsigned char * const metakeys =
+        (const unsigned char *)ose_getBundlePtr(vm_lo) + METATABLE_OFFSET;
+
+    /* 
+       set when the line has changed (or the cursor moved) since the
+       last line was submitted, i.e., when a frame is owed
+    */
+    int needframe = 0;
+    /* a binding was queued */
+    int bound = 0;
+    /* matches of a TAB that are to be pushed */
+    int32_t cfirst = 0, ccount = 0;
+    int32_t i = 0;
+    /* a line was submitted, with rest keys of the batch after it */
+    int accepted = 0;
+    int32_t rest = 0;
+    while(i < numchars)
+    {
+        if(!chunk
+           && (ose_peekType(vm_s) != OSETT_MESSAGE
+               || ose_peekMessageArgType(vm_s) != OSETT_INT32))
+        {
+            while(i < numchars)
+            {
+                ose_drop(vm_s);
+                ++i;
+            }
+            needframe = 1;
+            break;
+        }
+        if(l.instate == DEC_PASTE)
+        {
+            if(l.search)
+            {
+                endsearch(&l, vm_le, vm_lh, 1);
+            }
+            {
+                const int32_t pos = l.curpos;
+                i = chunk ? pastechunk(&l, chunk, i, numchars)
+                    : paste(&l, vm_s, i, numchars);
+                STAT_ADD(pastebytes, l.curpos - pos);
+                undorecord(vm_lu, UNDO_INS, pos, l.buf + pos,
+                           l.curpos - pos, l.lastcmd == CMD_INSERT);
+            }
+            l.lastcmd = CMD_INSERT;
+            resethistnum(vm_lh);
+            needframe = 1;
+            continue;
+        }
+        int32_t c = decode(&l,
+                           chunk ? chunk[i]
+                           : (unsigned char)ose_popInt32(vm_s),
+                           bracketedpaste);
+        ++i;
+        if(c >= 0 && l.search)
+        {
+            needframe = 1;
+            c = searchkey(&l, vm_le, vm_lh, c);
+        }
+        if(c < 0)
+        {
+            STAT_ADD(swallowed, 1);
+            continue;
+        }
+        const int32_t buflen = l.buflen;
+        const int32_t curpos = l.curpos;
+        const int32_t lastcmd = l.lastcmd;
+        needframe = 1;
+        l.lastcmd = CMD_NONE;
+        ccount = 0;
+        const int32_t act = c < META(0) ? keys[c] : metakeys[c & 0xff];
+        STAT_ADD(actions[act < NACTIONS ? act : ACT_NONE], 1);
+        switch(act)
+        {
+        case ACT_BOL:
+            /* jump to beginning of line (end of prompt) */
+            setcurpos(&l, promptlen);
+            break;
+        case ACT_BACKCHAR:
+            /* move back one char */
+            if(curpos > promptlen)
+            {
+                deccurpos(&l);
+            }
+            break;
+        case ACT_BINDING:
+        {
+            char addr[32] = "/!/lined/binding/";
+            keyname(addr + 17, c);
+            bound = 1;
+            ose_pushString(vm_c, addr);
+            ose_swap(vm_c);
+        }
+        break;
+        case ACT_DELCHAR:
+            /* delete char under cursor */
+            if(curpos < buflen)
+            {
+                const int32_t n = nextcp(&l) - curpos;
+                undorecord(vm_lu, UNDO_DEL, curpos, posttext(&l), n, 0);
+                delpost(&l, n);
+            }
+            break;
+        case ACT_EOL:
+            /* jump to end of line */
+            setcurpos(&l, buflen);
+            break;
+        case ACT_FWDCHAR:
+            /* move forward one char */
+            inccurpos(&l);
+            break;
+        case ACT_KILLLINE:
+            /* kill forward to end of line: the gap takes it */
+            l.lastcmd = lastcmd;
+            savekill(&l, vm_lk, posttext(&l), buflen - curpos, 0);
+            undorecord(vm_lu, UNDO_DEL, curpos, posttext(&l),
+                       buflen - curpos, 0);
+            delpost(&l, buflen - curpos);
+            resethistnum(vm_lh);
+            break;
+        case ACT_NEXTHIST:
+        {
+            /* get next history item */
+            dechistnum(vm_lh);
+            undoreset(vm_lu);
+            const char * const p = gethistitem(vm_lh);
+            loadhist(&l, p ? p : "", p ? strlen(p) : 0);
+        }
+        break;
+        case ACT_PREVHIST:
+        {
+            /* get previous history item */
+            inchistnum(vm_lh);
+            undoreset(vm_lu);
+            const char * const p = gethistitem(vm_lh);
+            if(p)
+            {
+                loadhist(&l, p, strlen(p));
+            }
+        }
+        break;
+        case ACT_SEARCH:
+        {
+            /* start a reverse incremental search */
+            char * const q = b + SEARCHQUERY_OFFSET;
+            q[0] = 0;
+            ose_writeInt32(vm_le, SEARCHLEN_OFFSET, 0);
+            ose_writeInt32(vm_le, SEARCHAGE_OFFSET, -1);
+            research(&l, vm_le, vm_lh, 0);
+            /* the line will be replaced */
+            undoreset(vm_lu);
+        }
+        break;
+        case ACT_COMPLETE:
+        {
+            /* complete the address before the cursor */
+            const int32_t n = complete(&l, osevm, &cfirst, &ccount);
+            undorecord(vm_lu, UNDO_INS, curpos, l.buf + curpos, n, 0);
+            resethistnum(vm_lh);
+        }
+        break;
+        case ACT_YANK:
+            /* yank the newest kill */
+            l.yanklen = yank(&l, vm_lk, 0);
+            undorecord(vm_lu, UNDO_INS, curpos, l.buf + curpos,
+                       l.yanklen, 0);
+            ose_writeInt32(vm_lk, KILLYANK_OFFSET, 0);
+            l.lastcmd = CMD_YANK;
+            resethistnum(vm_lh);
+            break;
+        case ACT_YANKPOP:
+        {
+            /* replace the text just yanked with the next older kill */
+            const int32_t count =
+                ose_readInt32(vm_lk, RING_COUNT(KILLCOUNT_OFFSET));
+            if(lastcmd == CMD_YANK && count > 1)
+            {
+                const int32_t age =
+                    (ose_readInt32(vm_lk, KILLYANK_OFFSET) + 1) % count;
+                const int32_t pos = curpos - l.yanklen;
+                undorecord(vm_lu, UNDO_DEL | UNDO_BACK, pos, l.buf + pos,
+                           l.yanklen, 0);
+                delpre(&l, l.yanklen);
+                l.yanklen = yank(&l, vm_lk, age);
+                undorecord(vm_lu, UNDO_INS | UNDO_JOIN, pos, l.buf + pos,
+                           l.yanklen, 0);
+                ose_writeInt32(vm_lk, KILLYANK_OFFSET, age);
+                l.lastcmd = CMD_YANK;
+            }
+        }
+        break;
+        case ACT_ACCEPT:
+            if(l.buflen == promptlen)
+            {
+                break;
+            }
+            accepted = 1;
+            rest = numchars - i;
+            numchars = i;
+            if(chunk)
+            {
+                /* chunk -> rest */
+                if(rest > 0)
                 {
-                    /* delete back to prev word break char */
-                    int32_t i = 0;
-                    if(chariswbc(bufp[curpos - 1], nwbcs, wbcs))
+                    if(argtype == OSETT_BLOB)
                     {
-                        delchar(vm_le);
-                        --curpos;
-                        ++i;
+                        ose_pushBlob(vm_s, rest, (const char *)chunk + i);
                     }
-                    while(!chariswbc(bufp[curpos - 1], nwbcs, wbcs)
-                          && curpos > promptlen)
+                    else
                     {
-                        delchar(vm_le);
-                        --curpos;
-                        ++i;
+                        ose_pushString(vm_s, (const char *)chunk + i);
                     }
-                    pushline(osevm, bufp, buflen, buflen - i,
-                             curpos);
-                    break;
-                }
-                default:
-                    pushline(osevm, bufp, buflen, buflen, curpos);
-                    break;
-                }
-                for( ; i < numchars; ++i)
-                {
-                    /* eat up the rest */
-                    ose_popInt32(vm_s);
+                    ose_swap(vm_s);
                 }
+                ose_drop(vm_s);
+            }
+            else if(rest > 0)
+            {
+                /* the rest of the batch is under the count */
+                ose_pushInt32(vm_s, rest);
+            }
+            /*
+               close the gap, so the line is contiguous and goes onto
+               the stack in a single copy, on top of the frame for the
+               keys before it, which is empty if nothing changed
+            */
+            setcurpos(&l, l.buflen);
+            pushline(osevm, vm_le, &l);
+            l.buf[l.buflen] = 0;
+            ose_pushString(vm_s, l.buf + promptlen);
+            clear(&l);
+            undoreset(vm_lu);
+            bound = 1;
+            ose_pushString(vm_c, "/!/lined/binding/RET");
+            ose_swap(vm_c);
+            resethistnum(vm_lh);
+            needframe = 0;
+            break;
+        case ACT_BACKDELCHAR:
+            if(curpos > promptlen)
+            {
+                const int32_t i = prevcp(&l);
+                undorecord(vm_lu, UNDO_DEL | UNDO_BACK, i, l.buf + i,
+                           curpos - i, 0);
+                delpre(&l, curpos - i);
+            }
+            resethistnum(vm_lh);
+            break;
+        case ACT_BACKWORD:
+            /* jump back to prev word break char */
+            setcurpos(&l, wordback(&l));
+            break;
+        case ACT_KILLWORD:
+        {
+            /* delete from curpos to next word break char */
+            const int32_t j = scanwbfwd(&l, posttext(&l), buflen - curpos);
+            l.lastcmd = lastcmd;
+            savekill(&l, vm_lk, posttext(&l), j, 0);
+            undorecord(vm_lu, UNDO_DEL, curpos, posttext(&l), j, 0);
+            delpost(&l, j);
+        }
+        break;
+        case ACT_FWDWORD:
+        {
+            /* jump forward to next word break char */
+            const char * const post = posttext(&l);
+            int32_t j = 0;
+            if(curpos < buflen && chariswbc(&l, post[0]))
+            {
+                ++j;
+            }
+            j += scanwbfwd(&l, post + j, buflen - curpos - j);
+            setcurpos(&l, curpos + j);
+        }
+        break;
+        case ACT_BACKKILLWORD:
+        {
+            /* delete back to prev word break char */
+            const int32_t i = wordback(&l);
+            l.lastcmd = lastcmd;
+            savekill(&l, vm_lk, l.buf + i, curpos - i, 1);
+            undorecord(vm_lu, UNDO_DEL | UNDO_BACK, i, l.buf + i,
+                       curpos - i, 0);
+            if(i < curpos)
+            {
+                delpre(&l, curpos - i);
             }
-            else
+        }
+        break;
+        case ACT_UNDO:
+            undo(&l, vm_lu);
+            break;
+        case ACT_REDO:
+            redo(&l, vm_lu);
+            break;
+        case ACT_INSERT:
+            if(c < META(0) && addchar(&l, c))
             {
-                /* we don't implement ESC at the moment */
-                pushline(osevm, b + BUF_OFFSET, buflen, buflen,
-                         curpos);
+                undorecord(vm_lu, UNDO_INS, curpos, l.buf + curpos, 1,
+                           lastcmd == CMD_INSERT);
+                l.lastcmd = CMD_INSERT;
             }
             break;
         default:
-            addchar(vm_le, c);
-            pushline(osevm, b + BUF_OFFSET,
-                     buflen, buflen + 1, curpos + 1);
             break;
         }
-    }    
+    }
+    if(chunk && !accepted)
+    {
+        ose_drop(vm_s);
+    }
+    if(ccount > 0)
+    {
+        pushcompletions(vm_s, cfirst, ccount);
+    }
+    if(needframe)
+    {
+        if(l.search)
+        {
+            pushsearch(osevm, &l, vm_le, vm_lh);
+        }
+        else
+        {
+            pushline(osevm, vm_le, &l);
+        }
+    }
+    if(bound)
+    {
+        pushsessionid(vm_s);
+    }
+    storestate(&l, vm_le);
+    STAT_END(charticks, t0);
+}
+
+/*
+  /lined/format writes its text through fmtbuf, which is pushed onto
+  the stack as a string of its own each time it fills. The strings
+  are bundled at the end if there's more than one.
+*/
+static char fmtbuf[OSE_LINED_FORMATCHUNK + 1];
+
+struct fmt
+{
+    ose_bundle vm_s;
+    int32_t len;
+    int32_t nchunks;
+    int32_t maxelems;
+    int32_t maxdepth;
+};
+
+static void fmtflush(struct fmt *f)
+{
+    fmtbuf[f->len] = 0;
+    ose_pushString(f->vm_s, fmtbuf);
+    ++f->nchunks;
+    f->len = 0;
+}
+
+static void fmtput(struct fmt *f, const char *s, int32_t n)
+{
+    while(n > 0)
+    {
+        int32_t k = OSE_LINED_FORMATCHUNK - f->len;
+        if(k > n)
+        {
+            k = n;
+        }
+        memcpy(fmtbuf + f->len, s, k);
+        f->len += k;
+        s += k;
+        n -= k;
+        if(f->len == OSE_LINED_FORMATCHUNK)
+        {
+            fmtflush(f);
+        }
+    }
+}
+
+static void fmtputs(struct fmt *f, const char *s)
+{
+    fmtput(f, s, strlen(s));
+}
+
+static void fmtint(struct fmt *f, int32_t i)
+{
+    char buf[16];
+    fmtput(f, buf, snprintf(buf, sizeof(buf), "%d", (int)i));
+}
+
+/* reads the 64 bit big-endian value at offset o of b */
+static uint64_t fmtread64(ose_bundle b, int32_t o)
+{
+    return ((uint64_t)(uint32_t)ose_readInt32(b, o) << 32)
+        | (uint32_t)ose_readInt32(b, o + 4);
+}
+
+/*
+  Formats the message at offset o of b, which is n bytes long: its
+  address, if it has one, and its arguments. Arguments of a type
+  that has no text form are shown as <x>, and skipped over with
+  libose's size for them.
+*/
+static void fmtmessage(struct fmt *f, ose_bundle b, int32_t o, int32_t n)
+{
+    const char * const p = ose_getBundlePtr(b);
+    const int32_t end = o + n;
+    const char *tt = p + o + ose_pstrlen(p + o);
+    int32_t d = (int32_t)(tt - p) + ose_pstrlen(tt);
+    int first = 1;
+    if(p[o])
+    {
+        fmtputs(f, p + o);
+        first = 0;
+    }
+    if(*tt++ != ',')
+    {
+        return;
+    }
+    for(; *tt; tt++)
+    {
+        char buf[40];
+        /* only the types with no data can be at the end */
+        if(d >= end && !strchr("TFNI", *tt))
+        {
+            break;
+        }
+        if(!first)
+        {
+            fmtput(f, " ", 1);
+        }
+        first = 0;
+        switch(*tt)
+        {
+        case 'i':
+            fmtint(f, ose_readInt32(b, d));
+            break;
+        case 'f':
+        {
+            const int32_t bits = ose_readInt32(b, d);
+            float v;
+            memcpy(&v, &bits, 4);
+            fmtput(f, buf, snprintf(buf, sizeof(buf), "%g", v));
+        }
+        break;
+        case 'h':
+            fmtput(f, buf, snprintf(buf, sizeof(buf), "%lld",
+                                    (long long)fmtread64(b, d)));
+            break;
+        case 'd':
+        {
+            const uint64_t bits = fmtread64(b, d);
+            double v;
+            memcpy(&v, &bits, 8);
+            fmtput(f, buf, snprintf(buf, sizeof(buf), "%g", v));
+        }
+        break;
+        case 't':
+            fmtput(f, buf, snprintf(buf, sizeof(buf), "<%08x.%08x>",
+                                    (unsigned)ose_readInt32(b, d),
+                                    (unsigned)ose_readInt32(b, d + 4)));
+            break;
+        case 'c':
+            buf[0] = '\'';
+            buf[1] = (char)ose_readInt32(b, d);
+            buf[2] = '\'';
+            fmtput(f, buf, 3);
+            break;
+        case 'm':
+        case 'r':
+            fmtput(f, buf, snprintf(buf, sizeof(buf), "<%c:%08x>", *tt,
+                                    (unsigned)ose_readInt32(b, d)));
+            break;
+        case 's':
+        case 'S':
+            fmtput(f, "\"", 1);
+            fmtputs(f, p + d);
+            fmtput(f, "\"", 1);
+            break;
+        case 'b':
+            fmtputs(f, "<blob:");
+            fmtint(f, ose_readInt32(b, d));
+            fmtput(f, ">", 1);
+            break;
+        case OSETT_ALIGNEDPTR:
+            fmtput(f, buf, snprintf(buf, sizeof(buf), "<%p>",
+                                    ose_readAlignedPtr(b, d)));
+            break;
+        case 'T':
+            fmtputs(f, "true");
+            break;
+        case 'F':
+            fmtputs(f, "false");
+            break;
+        case 'N':
+            fmtputs(f, "nil");
+            break;
+        case 'I':
+            fmtputs(f, "inf");
+            break;
+        default:
+            fmtput(f, "<", 1);
+            fmtput(f, tt, 1);
+            fmtput(f, ">", 1);
+            break;
+        }
+        d += ose_getPaddedTypedDatumSize(*tt, p + d);
+    }
+}
+
+/*
+  Formats the elements of b between offsets o and end as a bundle.
+  Only the last maxelems elements are shown, and bundles nested more
+  than maxdepth deep are shown as [...].
+*/
+static void fmtbundle(struct fmt *f, ose_bundle b, int32_t o,
+                      int32_t end, int32_t depth)
+{
+    const char * const p = ose_getBundlePtr(b);
+    int32_t n = 0, e;
+    for(e = o; e < end; e += 4 + ose_readInt32(b, e))
+    {
+        ++n;
+    }
+    fmtput(f, "[", 1);
+    if(f->maxelems > 0 && n > f->maxelems)
+    {
+        fmtputs(f, " ... ");
+        fmtint(f, n - f->maxelems);
+        fmtputs(f, " more,");
+        for(; n > f->maxelems; n--)
+        {
+            o += 4 + ose_readInt32(b, o);
+        }
+    }
+    for(e = o; e < end; e += 4 + ose_readInt32(b, e))
+    {
+        const int32_t size = ose_readInt32(b, e);
+        fmtputs(f, e == o ? " " : ", ");
+        if(!memcmp(p + e + 4, "#bundle", 8))
+        {
+            if(f->maxdepth > 0 && depth >= f->maxdepth)
+            {
+                fmtputs(f, "[...]");
+            }
+            else
+            {
+                fmtbundle(f, b, e + 4 + OSE_BUNDLE_HEADER_LEN,
+                          e + 4 + size, depth + 1);
+            }
+        }
+        else
+        {
+            fmtmessage(f, b, e + 4, size);
+        }
+    }
+    fmtputs(f, " ]");
+}
+
+/*
+  Pushes the stack, formatted as text. Most stacks fit in one string
+  of up to OSE_LINED_FORMATCHUNK bytes, which is pushed as it is.
+  Longer text is pushed as a bundle of such strings, in order, so the
+  only limit on its size is the room on the stack, and the caller
+  tells the two apart by the type on top.
+*/
+static void ose_lined_format(ose_bundle osevm)
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    struct fmt f;
+    resolve(osevm);
+    f.vm_s = vm_s;
+    f.len = 0;
+    f.nchunks = 0;
+    f.maxelems = ose_readInt32(cur->lo, FORMATELEMS_OFFSET);
+    f.maxdepth = ose_readInt32(cur->lo, FORMATDEPTH_OFFSET);
+    fmtbundle(&f, vm_s, OSE_BUNDLE_HEADER_LEN, ose_readSize(vm_s), 0);
+    fmtputs(&f, "\n\r");
+    if(f.len > 0 || f.nchunks == 0)
+    {
+        fmtflush(&f);
+    }
+    if(f.nchunks > 1)
+    {
+        ose_pushInt32(vm_s, f.nchunks);
+        ose_bundleFromTop(vm_s);
+    }
+}
+
+/*
+  Writes a CSI sequence with a numeric parameter into buf, e.g.
+  ESC [ 12 D, and returns the number of bytes written. A parameter
+  of 1 is the default, and is left out.
+*/
+static int32_t putcsi(char *buf, int32_t n, char final)
+{
+    char digits[12];
+    int32_t nd = 0, i = 0;
+    buf[i++] = ESC;
+    buf[i++] = '[';
+    if(n != 1)
+    {
+        do
+        {
+            digits[nd++] = '0' + (n % 10);
+            n /= 10;
+        } while(n > 0);
+    }
+    while(nd > 0)
+    {
+        buf[i++] = digits[--nd];
+    }
+    buf[i++] = final;
+    return i;
+}
+
+/* the number of bytes putcsi writes for n */
+static int32_t csilen(int32_t n)
+{
+    int32_t i = 3;
+    if(n == 1)
+    {
+        return i;
+    }
+    do
+    {
+        ++i;
+        n /= 10;
+    } while(n > 0);
+    return i;
+}
+
+/* byte i of the line, on either side of the gap */
+static char linebyte(const struct lined *l, int32_t i)
+{
+    return i < l->curpos ? l->buf[i] : posttext(l)[i - l->curpos];
+}
+
+/*
+  Copies the text that fills the n columns before byte pos of the
+  line into s, and returns its length, or -1 if it's longer than max
+  bytes, has a control char in it, or doesn't start on a column
+  boundary.
+*/
+static int32_t textbefore(const struct lined *l, int32_t pos, int32_t n,
+                          char *s, int32_t max)
+{
+    int32_t start = pos, w = 0, i;
+    while(w < n)
+    {
+        char cp[4];
+        int32_t k, len = 1;
+        for(k = 1; k <= 4 && k <= start; k++)
+        {
+            const unsigned char c = linebyte(l, start - k);
+            if(!ISCONT(c))
+            {
+                len = k == 1 || seqlen(c) >= k ? k : 1;
+                break;
+            }
+        }
+        if(len > start || pos - start + len > max)
+        {
+            return -1;
+        }
+        start -= len;
+        for(k = 0; k < len; k++)
+        {
+            cp[k] = linebyte(l, start + k);
+        }
+        if(len == 1 && ((unsigned char)cp[0] < 0x20 || cp[0] == DEL))
+        {
+            return -1;
+        }
+        w += textwidth(cp, len);
+    }
+    if(w > n)
+    {
+        return -1;
+    }
+    for(i = start; i < pos; i++)
+    {
+        s[i - start] = linebyte(l, i);
+    }
+    return pos - start;
+}
+
+/*
+  Writes the fewest bytes that move the terminal cursor from column
+  from to column to on the same row: backspaces, CSI n D or C, CSI n
+  G, a reprint of the text in between, or a carriage return and a
+  reprint of the text before to. The text comes from the line l, in
+  which to is byte pos; without l, only a bare carriage return is
+  tried.
+*/
+static int32_t movecol(char *buf, int32_t from, int32_t to,
+                       const struct lined *l, int32_t pos)
+{
+    const int32_t dist = to < from ? from - to : to - from;
+    char how = to < from ? 'D' : 'C', text[16];
+    int32_t best = csilen(dist), n = -1;
+    if(to == from)
+    {
+        return 0;
+    }
+    if(to < from && dist <= best)
+    {
+        best = dist;
+        how = BS;
+    }
+    if(csilen(to + 1) < best)
+    {
+        best = csilen(to + 1);
+        how = 'G';
+    }
+    if(to > from && l)
+    {
+        n = textbefore(l, pos, dist, text, best - 1);
+        if(n >= 0)
+        {
+            best = n;
+            how = 0;
+        }
+    }
+    if(n < 0 && (to == 0 || l))
+    {
+        n = to == 0 ? 0 : textbefore(l, pos, to, text, best - 2);
+        if(n >= 0 && n + 1 < best)
+        {
+            best = n + 1;
+            how = RET;
+        }
+    }
+    switch(how)
+    {
+    case BS:
+        memset(buf, BS, best);
+        return best;
+    case RET:
+        buf[0] = RET;
+        memcpy(buf + 1, text, best - 1);
+        return best;
+    case 0:
+        memcpy(buf, text, best);
+        return best;
+    case 'G':
+        return putcsi(buf, to + 1, how);
+    default:
+        return putcsi(buf, dist, how);
+    }
+}
+
+/*
+  Writes the bytes needed to move the terminal cursor from column
+  from to column to of the line, which is wrapped every width
+  columns: a row change, if any, and then the cheapest column change.
+  l and pos are passed on to movecol.
+*/
+static int32_t movecursor(char *buf, int32_t from, int32_t to,
+                          int32_t width, const struct lined *l,
+                          int32_t pos)
+{
+    int32_t n = 0;
+    if(width <= 0)
+    {
+        return movecol(buf, from, to, l, pos);
+    }
+    {
+        const int32_t fromrow = from / width, torow = to / width;
+        if(torow < fromrow)
+        {
+            n += putcsi(buf, fromrow - torow, 'A');
+        }
+        else if(torow > fromrow)
+        {
+            n += putcsi(buf, torow - fromrow, 'B');
+        }
+    }
+    return n + movecol(buf + n, from % width, to % width, l, pos);
+}
+
+/*
+  Writes a space into each column the terminal would leave blank when
+  it wraps a wide glyph early, so that what was there before is
+  overwritten. The span on top of the stack starts at column col.
+*/
+static void padspan(ose_bundle vm_s, int32_t col, int32_t width)
+{
+    char * const s = (char *)ose_peekString(vm_s);
+    const int32_t n = strlen(s);
+    int32_t i = 0, from = 0;
+    ose_pushString(vm_s, "");
+    while(i < n)
+    {
+        int32_t cw;
+        const int32_t len = cpat(s, i, n, &cw);
+        if(cw == 2 && col % width == width - 1)
+        {
+            const char c = s[i];
+            s[i] = 0;
+            ose_pushString(vm_s, s + from);
+            ose_push(vm_s);
+            ose_concatenateStrings(vm_s);
+            s[i] = c;
+            ose_pushString(vm_s, " ");
+            ose_push(vm_s);
+            ose_concatenateStrings(vm_s);
+            from = i;
+            ++col;
+        }
+        col += cw;
+        i += len;
+    }
+    ose_pushString(vm_s, s + from);
+    ose_push(vm_s);
+    ose_concatenateStrings(vm_s);
+    ose_swap(vm_s);
+    ose_drop(vm_s);
+}
+
+/*
+  The moves and erases written before and after the span. Each move
+  is at most a row change and a column change, neither of which is
+  longer than a CSI sequence.
+*/
+static char printpre[32], printpost[48];
+
+/*
+  Turns a render frame into the bytes to write to the terminal: a
+  move to the start of the changed span, the span, an erase of what's
+  left of the old line, and a move to the cursor. /le/rd keeps the
+  column the terminal cursor is at. If /lo/tw is set, the line is
+  wrapped at that width: positions are rows and columns of the
+  wrapped line, and only the rows from the start of the span down are
+  written. A span that ends at the right margin leaves the terminal
+  waiting to wrap, so it's followed by CR LF to put the cursor at the
+  start of the next row. Moves may reprint text of the line that's
+  already on the terminal, when the frame is of the line as it is
+  now, and it isn't being searched.
+  When the line is wrapped, the columns of the frame are columns of
+  text, and wide glyphs wrapped early by the terminal are accounted
+  for with /le/lp. Only the span is laid out: the glyphs before it
+  haven't moved, so a frame costs the rows it changes. /le/rd keeps
+  the end of the line as laid out, which is what's compared to see if
+  there's anything left to erase.
+*/
+static void ose_lined_print(ose_bundle osevm)
+{
+    STAT_START(t0);
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    resolve(osevm);
+    ose_bundle vm_le = cur->le;
+    ose_bundle vm_lo = cur->lo;
+    /* arg check */
+
+    int32_t curpos = ose_popInt32(vm_s);
+    int32_t newlen = ose_popInt32(vm_s);
+    /* the old width; /le/rd has the old end as laid out */
+    ose_drop(vm_s);
+    const char * const span = ose_peekString(vm_s);
+    const int32_t spanbytes = strlen(span);
+    const int32_t spanlen = textwidth(span, spanbytes);
+    const int32_t width = ose_readInt32(vm_lo, TERMWIDTH_OFFSET);
+    const int32_t oldend = ose_readInt32(vm_le, TERMEND_OFFSET);
+    int32_t termpos = ose_readInt32(vm_le, TERMPOS_OFFSET);
+    int32_t spanpos = newlen - spanlen;
+    char * const pre = printpre, * const post = printpost;
+    int32_t npre = 0, npost = 0;
+    struct lined line, *l = &line;
+    loadstate(l, vm_le, vm_lo);
+    if(l->search || newlen != l->cols || curpos != l->curcol
+       || spanbytes > l->buflen)
+    {
+        l = NULL;
+    }
+    if(width > 1)
+    {
+        const int32_t np = ose_readInt32(vm_le, PADWIDTH_OFFSET) == width
+            ? ose_readInt32(vm_le, PADCOUNT_OFFSET) : -1;
+        ose_writeInt32(vm_le, PADWIDTH_OFFSET, width);
+        if(np < 0 && spanpos > 0 && l)
+        {
+            /* lay out the line before the span again */
+            const int32_t sb = l->buflen - spanbytes;
+            ose_writeInt32(vm_le, PADCOUNT_OFFSET, 0);
+            if(sb <= l->curpos)
+            {
+                layoutpads(vm_le, l->buf, sb, 0, width);
+            }
+            else
+            {
+                layoutpads(vm_le, l->buf, l->curpos, 0, width);
+                layoutpads(vm_le, posttext(l), sb - l->curpos, l->curcol,
+                           width);
+            }
+        }
+        else
+        {
+            /* only the glyphs before the span are still where they were */
+            ose_writeInt32(vm_le, PADCOUNT_OFFSET,
+                           np > 0 ? padsbefore(vm_le, spanpos) : 0);
+        }
+        newlen = layoutpads(vm_le, span, spanbytes, spanpos, width);
+        if(ose_readInt32(vm_le, PADCOUNT_OFFSET) > 0)
+        {
+            spanpos += padsbefore(vm_le, spanpos);
+            curpos += padsbefore(vm_le, curpos);
+        }
+    }
+    if(spanlen > 0 || oldend != newlen)
+    {
+        /* go to the start of the changed span and write it out */
+        npre = movecursor(pre, termpos, spanpos, width,
+                          l, l ? l->buflen - spanbytes : 0);
+        if(width > 1 && newlen - spanpos != spanlen)
+        {
+            padspan(vm_s, spanpos, width);
+        }
+        termpos = newlen;
+        if(width > 0 && spanlen > 0 && newlen % width == 0)
+        {
+            post[npost++] = RET;
+            post[npost++] = LF;
+        }
+        if(oldend > newlen)
+        {
+            /* erase what's left over from the old line */
+            post[npost++] = ESC;
+            post[npost++] = '[';
+            post[npost++] = width > 0 && (oldend - 1) / width > newlen / width
+                ? 'J' : 'K';
+        }
+    }
+    npost += movecursor(post + npost, termpos, curpos, width,
+                        l, l ? l->curpos : 0);
+    pre[npre] = 0;
+    post[npost] = 0;
+    ose_writeInt32(vm_le, TERMPOS_OFFSET, curpos);
+    ose_writeInt32(vm_le, TERMEND_OFFSET, newlen);
+    if(npre)
+    {
+        ose_pushString(vm_s, pre);
+        ose_swap(vm_s);
+        ose_push(vm_s);
+        ose_concatenateStrings(vm_s);
+    }
+    if(npost)
+    {
+        ose_pushString(vm_s, post);
+        ose_push(vm_s);
+        ose_concatenateStrings(vm_s);
+    }
+    STAT_ADD(renders, 1);
+    STAT_ADD(bytes, strlen(ose_peekString(vm_s)));
+    STAT_END(printticks, t0);
+}
+
+static void ose_lined_prompt(ose_bundle osevm)
+{
+    resolve(osevm);
+    ose_bundle vm_le = cur->le;
+    ose_bundle vm_lo = cur->lo;
+    const char * const promptstring = PROMPTSTRING;
+    struct lined l;
+    loadstate(&l, vm_le, vm_lo);
+    /* the prompt starts a row of its own */
+    ose_writeInt32(vm_le, TERMLEN_OFFSET, 0);
+    ose_writeInt32(vm_le, TERMPOS_OFFSET, 0);
+    ose_writeInt32(vm_le, TERMEND_OFFSET, 0);
+    ose_writeInt32(vm_le, PADCOUNT_OFFSET, 0);
+    {
+        int i = 0;
+        for(; i < l.promptlen; i++)
+        {
+            addchar(&l, promptstring[i]);
+        }
+    }
+    pushline(osevm, vm_le, &l);
+    storestate(&l, vm_le);
 }
 
-static void ose_lined_format(ose_bundle osevm)
+static void ose_lined_init(ose_bundle osevm)
 {
     ose_bundle vm_s = OSEVM_STACK(osevm);
-    char buf[8192];
-    memset(buf, 0, 8192);
-    int32_t n = ose_pprintBundle(vm_s, buf, 8192);
-    buf[n++] = '\n';
-    buf[n++] = '\r';
-    ose_pushString(vm_s, buf);
+    resolve(osevm);
 }
 
-static void ose_lined_print(ose_bundle osevm)
+/*
+  /lined/key/bind binds a key to an action. The top of the stack is
+  the name of the action (one of actionnames), and below it is the
+  key: its code (META(c) for ESC c), or its name, as given by keyname.
+  A key bound to "binding" queues /lined/binding/<key name>.
+*/
+static void ose_lined_bindKey(ose_bundle osevm)
 {
     ose_bundle vm_s = OSEVM_STACK(osevm);
-    /* arg check */
-
-    int32_t curpos = ose_popInt32(vm_s);
-    int32_t newlen = ose_popInt32(vm_s);
-    /* int32_t oldlen =  */ose_popInt32(vm_s);
-    if(curpos < newlen)
+    char *b;
+    int32_t act, c = -1;
+    resolve(osevm);
+    b = ose_getBundlePtr(cur->lo);
+    if(!ose_bundleHasAtLeastNElems(vm_s, 2)
+       || ose_peekType(vm_s) != OSETT_MESSAGE
+       || ose_peekMessageArgType(vm_s) != OSETT_STRING)
+    {
+        return;
+    }
+    for(act = 0; act < NACTIONS; act++)
     {
-        char buf[(newlen - curpos) + 1];
-        int i;
-        for(i = 0; i < newlen - curpos; i++)
+        if(!strcmp(ose_peekString(vm_s), actionnames[act]))
         {
-            buf[i] = '\b';
+            break;
         }
-        buf[newlen - curpos] = 0;
-        ose_pushString(vm_s, buf);
-        ose_push(vm_s);
-        ose_concatenateStrings(vm_s);
     }
+    if(act == NACTIONS)
+    {
+        return;
+    }
+    ose_drop(vm_s);
+    if(ose_peekType(vm_s) != OSETT_MESSAGE)
+    {
+        return;
+    }
+    if(ose_peekMessageArgType(vm_s) == OSETT_INT32)
+    {
+        c = ose_popInt32(vm_s);
+    }
+    else if(ose_peekMessageArgType(vm_s) == OSETT_STRING)
+    {
+        const char * const name = ose_peekString(vm_s);
+        int32_t k;
+        for(k = 0; k < META(0xff) + 1; k++)
+        {
+            char kn[8];
+            keyname(kn, k);
+            if(!strcmp(kn, name))
+            {
+                c = k;
+                break;
+            }
+        }
+        ose_drop(vm_s);
+    }
+    if(c < 0 || c > META(0xff))
+    {
+        return;
+    }
+    b[(c < META(0) ? KEYTABLE_OFFSET : METATABLE_OFFSET) + (c & 0xff)]
+        = act;
 }
 
-static void ose_lined_prompt(ose_bundle osevm)
+/*
+  Appends len bytes of str to the history ring along with their
+  search signature. Returns the offset of the entry, or -1.
+*/
+static int32_t histadd(ose_bundle vm_lh, const char *str, int32_t len)
 {
-    ose_bundle vm_s = OSEVM_STACK(osevm);
-    ose_bundle vm_le = ose_enter(osevm, "/le");
-    ose_assert(ose_getBundlePtr(vm_le));
-    ose_bundle vm_lo = ose_enter(osevm, "/lo");
-    ose_assert(ose_getBundlePtr(vm_lo));
-    const char * const bufp = BUFP;
-    const char * const promptstring = PROMPTSTRING;
-    const int32_t promptlen = strlen(promptstring);
+    const int32_t o = ringalloc(vm_lh, HISTCOUNT_OFFSET, len);
+    if(o >= 0)
     {
-        int i = 0;
-        for(; i < promptlen; i++)
+        const int32_t so = HISTSIG_OFFSET
+            + ringslot(vm_lh, HISTCOUNT_OFFSET, 0) * 16;
+        uint32_t sig[4];
+        int32_t i;
+        memcpy(ose_getBundlePtr(vm_lh) + o + 4, str, len);
+        completeaddtext(cachedlc, str, len);
+        histsig(str, len, sig);
+        for(i = 0; i < 4; i++)
         {
-            addchar(vm_le, promptstring[i]);
+            ose_writeInt32(vm_lh, so + i * 4, (int32_t)sig[i]);
         }
     }
-    ose_pushString(vm_s, bufp);
-    ose_pushInt32(vm_s, 0);
-    ose_pushInt32(vm_s, promptlen);
-    ose_pushInt32(vm_s, promptlen);
+    return o;
 }
 
-static void ose_lined_init(ose_bundle osevm)
+#ifdef OSE_LINED_HISTFILE
+/*
+  Writes the entry at offset o to the history file with a single
+  write of its bytes and terminating null. Returns 0, or the error
+  if the write failed or fell short.
+*/
+static int histwrite(ose_bundle vm_lh, int32_t fd, int32_t o)
+{
+    const int32_t len = ose_readInt32(vm_lh, o);
+    const ssize_t n = write(fd, ose_getBundlePtr(vm_lh) + o + 4, len + 1);
+    return n == len + 1 ? 0 : n < 0 ? errno : ENOSPC;
+}
+
+/*
+  Reports a failed write to the history file. The file is closed,
+  so entries are counted as unsaved until /lined/hist/save is called
+  again, and a message is pushed for /lined/binding/histerror, which
+  is queued.
+*/
+static void histfail(ose_bundle osevm, ose_bundle vm_lh, int err)
 {
     ose_bundle vm_s = OSEVM_STACK(osevm);
+    ose_bundle vm_c = OSEVM_CONTROL(osevm);
+    char msg[128];
+    close(ose_readInt32(vm_lh, HISTFD_OFFSET));
+    ose_writeInt32(vm_lh, HISTFD_OFFSET, -1);
+    snprintf(msg, sizeof(msg), "lined: can't write history: %s",
+             strerror(err));
+    ose_pushString(vm_s, msg);
+    ose_pushString(vm_c, "/!/lined/binding/histerror");
+    ose_swap(vm_c);
+    pushsessionid(vm_s);
 }
+#endif
 
+/*
+  Appends the string on top of the stack to the history ring. Only
+  the new entry is written; old entries are evicted by advancing the
+  tail of the ring.
+*/
 static void ose_lined_addToHist(ose_bundle osevm)
 {
     ose_bundle vm_s = OSEVM_STACK(osevm);
-    ose_bundle vm_lh = ose_enter(osevm, "/lh");
-    ose_assert(ose_getBundlePtr(vm_lh));
+    resolve(osevm);
+    ose_bundle vm_lh = cur->lh;
     if(ose_bundleHasAtLeastNElems(vm_s, 1)
        && ose_peekType(vm_s) == OSETT_MESSAGE
        && ose_peekMessageArgType(vm_s) == OSETT_STRING)
     {
         const char * const str = ose_peekString(vm_s);
-        const int32_t len = ose_pstrlen(str);
-        const int32_t msgsize = len + 12;
-        int32_t freespace = ose_spaceAvailable(vm_lh);
-        if(freespace - msgsize <= 20)
+#ifdef OSE_LINED_STATS
+        const int32_t count = ose_readInt32(vm_lh, HISTCOUNT_OFFSET);
+#endif
+        const int32_t o = histadd(vm_lh, str, strlen(str));
+        if(o < 0)
+        {
+            return;
+        }
+        STAT_ADD(histevictions,
+                 count + 1 - ose_readInt32(vm_lh, HISTCOUNT_OFFSET));
+#ifdef OSE_LINED_HISTFILE
         {
-            ose_swap(vm_lh);
-            while(freespace - msgsize <= 20 + msgsize + 4)
+            const int32_t fd = ose_readInt32(vm_lh, HISTFD_OFFSET);
+            const int err = fd >= 0 ? histwrite(vm_lh, fd, o) : 0;
+            if(fd < 0 || err)
+            {
+                ose_writeInt32(vm_lh, HISTUNSAVED_OFFSET,
+                               ose_readInt32(vm_lh, HISTUNSAVED_OFFSET)
+                               + 1);
+            }
+            if(err)
             {
-                ose_pop(vm_lh);
-                ose_drop(vm_lh);
-                freespace = ose_spaceAvailable(vm_lh);
+                histfail(osevm, vm_lh, err);
             }
-            ose_swap(vm_lh);
         }
-        ose_push(vm_lh);
-        ose_pushString(vm_lh, str);
-        ose_swap(vm_lh);
-        ose_unpackDrop(vm_lh);
-        ose_bundleAll(vm_lh);
-        ose_pop(vm_lh);
+#endif
+    }
+}
+
+#ifdef OSE_LINED_STATS
+static void pushstat(ose_bundle vm_s, const char *addr, uint32_t n)
+{
+    ose_pushMessage(vm_s, addr, strlen(addr), 1, OSETT_INT32, (int32_t)n);
+    ose_push(vm_s);
+}
+
+static void pushstathist(ose_bundle vm_s, const char *addr,
+                         const uint32_t *hist)
+{
+    int32_t i;
+    ose_pushMessage(vm_s, addr, strlen(addr), 0);
+    for(i = 0; i < STATS_NBUCKETS; i++)
+    {
+        ose_pushInt32(vm_s, (int32_t)hist[i]);
+        ose_push(vm_s);
+    }
+    ose_push(vm_s);
+}
+
+/*
+  /lined/stats pushes a bundle of the counters, e.g. /keys/yank, and
+  the histograms, /char/ticks and /print/ticks, as messages.
+*/
+static void ose_lined_stats(ose_bundle osevm)
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    char addr[64];
+    int32_t i;
+    ose_pushBundle(vm_s);
+    for(i = 0; i < NACTIONS; i++)
+    {
+        snprintf(addr, sizeof(addr), "/keys/%s", actionnames[i]);
+        pushstat(vm_s, addr, stats.actions[i]);
+    }
+    pushstat(vm_s, "/keys/pasted", stats.pastebytes);
+    pushstat(vm_s, "/keys/swallowed", stats.swallowed);
+    pushstat(vm_s, "/print/renders", stats.renders);
+    pushstat(vm_s, "/print/bytes", stats.bytes);
+    pushstat(vm_s, "/hist/lookups", stats.histlookups);
+    pushstat(vm_s, "/hist/evictions", stats.histevictions);
+    pushstathist(vm_s, "/char/ticks", stats.charticks);
+    pushstathist(vm_s, "/print/ticks", stats.printticks);
+}
+#endif
+
+#ifdef OSE_LINED_HISTFILE
+/*
+  The history file is an append-only log of entries, each terminated
+  by a null. /lined/hist/load maps it and walks back from the end,
+  so only the pages holding the newest entries that fit in /lh are
+  touched. An incomplete entry at the end, left by an interrupted
+  write, is ignored.
+*/
+static void ose_lined_loadHist(ose_bundle osevm)
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    resolve(osevm);
+    ose_bundle vm_lh = cur->lh;
+    if(!ose_bundleHasAtLeastNElems(vm_s, 1)
+       || ose_peekType(vm_s) != OSETT_MESSAGE
+       || ose_peekMessageArgType(vm_s) != OSETT_STRING)
+    {
+        return;
+    }
+    const int fd = open(ose_peekString(vm_s), O_RDONLY);
+    ose_drop(vm_s);
+    if(fd < 0)
+    {
+        return;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+    const size_t size = st.st_size;
+    const char * const map = mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+                                  fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        return;
+    }
+    const int32_t datasize =
+        ose_readInt32(vm_lh, ringdata(vm_lh, HISTCOUNT_OFFSET) - 4);
+    const int32_t nslots = ringnslots(vm_lh, HISTCOUNT_OFFSET);
+    size_t end = size, start;
+    int32_t n = 0, used = 0;
+    /* drop an incomplete entry */
+    while(end > 0 && map[end - 1] != '\0')
+    {
+        --end;
+    }
+    /* find the oldest entry that still fits */
+    start = end;
+    while(start > 0 && n < nslots)
+    {
+        size_t e = start - 1;
+        while(e > 0 && map[e - 1] != '\0')
+        {
+            --e;
+        }
+        if(start - 1 - e > (size_t)datasize)
+        {
+            break;
+        }
+        const int32_t need = 4 + ose_pnbytes(start - 1 - e);
+        if(used + need > datasize)
         {
-            const int32_t o = ose_getLastBundleElemOffset(vm_lh);
-            ose_writeInt32(vm_lh, o + 12,
-                           ose_readInt32(vm_lh, o + 12) + 1);
+            break;
         }
+        used += need;
+        ++n;
+        start = e;
+    }
+    while(start < end)
+    {
+        const size_t len = strlen(map + start);
+        histadd(vm_lh, map + start, len);
+        start += len + 1;
     }
+    munmap((void *)map, size);
+    resethistnum(vm_lh);
 }
 
-void ose_main(ose_bundle osevm)
+/*
+  Appends entries that haven't been written to a file yet to the
+  history file, and keeps it open so that every entry added after
+  this is appended as it comes in.
+*/
+static void ose_lined_saveHist(ose_bundle osevm)
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    resolve(osevm);
+    ose_bundle vm_lh = cur->lh;
+    if(!ose_bundleHasAtLeastNElems(vm_s, 1)
+       || ose_peekType(vm_s) != OSETT_MESSAGE
+       || ose_peekMessageArgType(vm_s) != OSETT_STRING)
+    {
+        return;
+    }
+    const int fd = open(ose_peekString(vm_s),
+                        O_WRONLY | O_APPEND | O_CREAT, 0600);
+    ose_drop(vm_s);
+    if(fd < 0)
+    {
+        return;
+    }
+    const int32_t oldfd = ose_readInt32(vm_lh, HISTFD_OFFSET);
+    if(oldfd >= 0)
+    {
+        close(oldfd);
+    }
+    const int32_t count = ose_readInt32(vm_lh, HISTCOUNT_OFFSET);
+    int32_t age = ose_readInt32(vm_lh, HISTUNSAVED_OFFSET);
+    int err = 0;
+    if(age > count)
+    {
+        age = count;
+    }
+    while(age > 0 && !err)
+    {
+        err = histwrite(vm_lh, fd, ringget(vm_lh, HISTCOUNT_OFFSET,
+                                           age - 1));
+        if(!err)
+        {
+            --age;
+        }
+    }
+    ose_writeInt32(vm_lh, HISTFD_OFFSET, fd);
+    ose_writeInt32(vm_lh, HISTUNSAVED_OFFSET, age);
+    if(err)
+    {
+        histfail(osevm, vm_lh, err);
+    }
+}
+#endif
+
+/*
+  Fills the empty contexts of session s in. Its history is left
+  alone if it shares the history of session 0.
+*/
+static void initsession(struct session *s, int ownhist)
 {
-    /* main lined bundle */
-    ose_pushContextMessage(osevm, 8192, "/le");
-    ose_bundle vm_le = ose_enter(osevm, "/le");
-    /* options */
-    ose_pushContextMessage(osevm, 512, "/lo");
-    ose_bundle vm_lo = ose_enter(osevm, "/lo");
-    /* history */
-    ose_pushContextMessage(osevm, 8192, "/lh");
-    ose_bundle vm_lh = ose_enter(osevm, "/lh");
-    /* kill ring */
-    ose_pushContextMessage(osevm, 8192, "/lk");
-    ose_bundle vm_lk = ose_enter(osevm, "/lk");
+    ose_bundle vm_le = s->le;
+    ose_bundle vm_lo = s->lo;
+    ose_bundle vm_lh = s->lh;
+    ose_bundle vm_lk = s->lk;
+    ose_bundle vm_lu = s->lu;
     /* buf size */
     ose_pushMessage(vm_le, "/bs", 3, 1,
                     OSETT_INT32, OSE_LINED_BUFSIZE);
@@ -704,24 +4020,327 @@ void ose_main(ose_bundle osevm)
     /* cursor pos */
     ose_pushMessage(vm_le, "/cp", 3, 1,
                     OSETT_INT32, 0);
+    /* cursor column, line width */
+    ose_pushMessage(vm_le, "/cc", 3, 2,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0);
+    /* 
+       redraw state: damage, terminal line length, terminal cursor,
+       terminal line end
+    */
+    ose_pushMessage(vm_le, "/rd", 3, 4,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0);
+    /* input decoder state */
+    ose_pushMessage(vm_le, "/is", 3, 3,
+                    OSETT_INT32, DEC_GROUND,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0);
+    /* reverse history search */
+    ose_pushMessage(vm_le, "/sr", 3, 4,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, -1,
+                    OSETT_INT32, 0,
+                    OSETT_BLOB, OSE_LINED_SEARCHMAX, NULL);
+    /* heap buffer */
+    ose_pushMessage(vm_le, "/bh", 3, 1,
+                    OSETT_BLOB, 8, NULL);
+    setheapbuf(vm_le, NULL);
+    /* compiled word break chars; compiled on first use */
+    ose_pushMessage(vm_le, "/wm", 3, 2,
+                    OSETT_BLOB, 32, NULL,
+                    OSETT_BLOB, OSE_LINED_WBMAX, NULL);
+    /* kill ring state */
+    ose_pushMessage(vm_le, "/kc", 3, 2,
+                    OSETT_INT32, CMD_NONE,
+                    OSETT_INT32, 0);
     /* buf */
     ose_pushMessage(vm_le, "/bf", 3, 1,
                     OSETT_BLOB, OSE_LINED_BUFSIZE, NULL);
+    /* wide glyphs wrapped early */
+    ose_pushMessage(vm_le, "/lp", 3, 3,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0,
+                    OSETT_BLOB, OSE_LINED_MAXPADS * 4, NULL);
+    /* recognize bracketed pastes */
+    ose_pushMessage(vm_lo, "/bp", 3, 1,
+                    OSETT_INT32, OSE_LINED_BRACKETEDPASTE);
+    /* max size of the edit buffer */
+    ose_pushMessage(vm_lo, "/bm", 3, 1,
+                    OSETT_INT32, OSE_LINED_BUFMAX);
+    /* terminal width */
+    ose_pushMessage(vm_lo, "/tw", 3, 1,
+                    OSETT_INT32, OSE_LINED_TERMWIDTH);
+    /* key dispatch tables */
+    ose_pushMessage(vm_lo, "/kt", 3, 1,
+                    OSETT_BLOB, 256, NULL);
+    ose_pushMessage(vm_lo, "/km", 3, 1,
+                    OSETT_BLOB, 256, NULL);
+    initkeys(vm_lo);
+    /* format limits */
+    ose_pushMessage(vm_lo, "/fl", 3, 2,
+                    OSETT_INT32, OSE_LINED_FORMATMAXELEMS,
+                    OSETT_INT32, OSE_LINED_FORMATMAXDEPTH);
     /* prompt string */
     ose_pushMessage(vm_lo, "/ps", 3, 1,
                     OSETT_STRING, OSE_LINED_PROMPTSTRING);
     /* word break chars */
     ose_pushMessage(vm_lo, "/wb", 3, 1,
                     OSETT_STRING, OSE_LINED_WORDBREAKCHARS);
-    /* history */
-    /* ose_pushMessage(vm_lh, "/en", 3, 1, */
-    /*                 OSETT_INT32, -1); */
-    /* ose_pushMessage(vm_lh, "/lh", 3, 0); */
-    ose_pushBundle(vm_lh);
-    ose_pushMessage(vm_lh, "/en", 3, 2,
-                    OSETT_INT32, 0, OSETT_INT32, -1);
-    /* kill ring */
-    ose_pushMessage(vm_lk, "/lk", 3, 0);
+    if(ownhist)
+    {
+        /* history: count, histnum, first, head */
+        ose_pushMessage(vm_lh, "/en", 3, 4,
+                        OSETT_INT32, 0, OSETT_INT32, -1,
+                        OSETT_INT32, 0, OSETT_INT32, 0);
+        /* history index */
+        ose_pushMessage(vm_lh, "/hx", 3, 1,
+                        OSETT_BLOB, OSE_LINED_HISTMAX * 4, NULL);
+        /* history data */
+        ose_pushMessage(vm_lh, "/hd", 3, 1,
+                        OSETT_BLOB, OSE_LINED_HISTDATASIZE, NULL);
+        /* history search signatures */
+        ose_pushMessage(vm_lh, "/hs", 3, 1,
+                        OSETT_BLOB, OSE_LINED_HISTMAX * 16, NULL);
+        /* history file */
+        ose_pushMessage(vm_lh, "/lf", 3, 2,
+                        OSETT_INT32, -1,
+                        OSETT_INT32, 0);
+    }
+    /* kill ring: count, yank age, first, head */
+    ose_pushMessage(vm_lk, "/lk", 3, 4,
+                    OSETT_INT32, 0, OSETT_INT32, 0,
+                    OSETT_INT32, 0, OSETT_INT32, 0);
+    /* kill ring index */
+    ose_pushMessage(vm_lk, "/kx", 3, 1,
+                    OSETT_BLOB, OSE_LINED_KILLMAX * 4, NULL);
+    /* killed text */
+    ose_pushMessage(vm_lk, "/kd", 3, 1,
+                    OSETT_BLOB, OSE_LINED_KILLDATASIZE, NULL);
+    /* undo log: count, number undone, first, head */
+    ose_pushMessage(vm_lu, "/lu", 3, 4,
+                    OSETT_INT32, 0, OSETT_INT32, 0,
+                    OSETT_INT32, 0, OSETT_INT32, 0);
+    /* undo log index */
+    ose_pushMessage(vm_lu, "/ux", 3, 1,
+                    OSETT_BLOB, OSE_LINED_UNDOMAX * 4, NULL);
+    /* undo records */
+    ose_pushMessage(vm_lu, "/ud", 3, 1,
+                    OSETT_BLOB, OSE_LINED_UNDODATASIZE, NULL);
+}
+
+/*
+  Makes the contexts of session id, reusing (and emptying) the ones
+  a freed session with the same id left behind, and marks it in use
+  with the flags in state.
+*/
+static void makesession(ose_bundle osevm, int32_t id, int32_t state)
+{
+    static const char * const bases[] = {
+        "/le", "/lo", "/lh", "/lk", "/lu"
+    };
+    /* /lh has room for /hs on top of the entries */
+    static const int32_t sizes[] = {
+        8192, 1024, 8192 + OSE_LINED_HISTMAX * 16, 8192,
+        OSE_LINED_UNDOCONTEXTSIZE
+    };
+    char * const ss = ose_getBundlePtr(cachedls) + SESSIONSTATE_OFFSET;
+    struct session * const s = sessions + id;
+    ose_bundle * const b[] = { &s->le, &s->lo, &s->lh, &s->lk, &s->lu };
+    const int ownhist = !(state & SESSION_SHAREDHIST);
+    const int32_t made = ss[id];
+    int i;
+    for(i = 0; i < 5; i++)
+    {
+        const int32_t flag = i == 2 ? SESSION_HASHIST : SESSION_MADE;
+        char name[16];
+        if(i == 2 && !ownhist)
+        {
+            *b[i] = sessions[0].lh;
+            continue;
+        }
+        sessionname(name, bases[i], id);
+        if(made & flag)
+        {
+            *b[i] = ose_enter(osevm, name);
+            ose_clear(*b[i]);
+        }
+        else
+        {
+            ose_pushContextMessage(osevm, sizes[i], name);
+            *b[i] = ose_enter(osevm, name);
+        }
+    }
+    initsession(s, ownhist);
+    /* only which contexts exist carries over from a freed session */
+    ss[id] = (made & (SESSION_MADE | SESSION_HASHIST)) | state
+        | SESSION_MADE | (ownhist ? SESSION_HASHIST : 0);
+}
+
+/*
+  /lined/session/new makes a session and pushes its id, or -1 if
+  there are already OSE_LINED_MAXSESSIONS. An int on top of the stack
+  is popped, and if it's nonzero, the session shares the history of
+  session 0 instead of having its own.
+*/
+static void ose_lined_sessionNew(ose_bundle osevm)
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    int32_t state = SESSION_INUSE;
+    int32_t id = 1;
+    resolve(osevm);
+    if(ose_bundleHasAtLeastNElems(vm_s, 1)
+       && ose_peekType(vm_s) == OSETT_MESSAGE
+       && ose_peekMessageArgType(vm_s) == OSETT_INT32
+       && ose_popInt32(vm_s))
+    {
+        state |= SESSION_SHAREDHIST;
+    }
+    while(id < OSE_LINED_MAXSESSIONS
+          && (ose_getBundlePtr(cachedls)[SESSIONSTATE_OFFSET + id]
+              & SESSION_INUSE))
+    {
+        ++id;
+    }
+    if(id == OSE_LINED_MAXSESSIONS)
+    {
+        ose_pushInt32(vm_s, -1);
+        return;
+    }
+    makesession(osevm, id, state);
+    ose_pushInt32(vm_s, id);
+}
+
+/*
+  /lined/session/free pops a session id and frees the session. Its
+  contexts stay in the VM and are reused by the next session made
+  with that id. Session 0 can't be freed.
+*/
+static void ose_lined_sessionFree(ose_bundle osevm)
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    struct session *s;
+    int32_t id;
+    resolve(osevm);
+    if(!ose_bundleHasAtLeastNElems(vm_s, 1)
+       || ose_peekType(vm_s) != OSETT_MESSAGE
+       || ose_peekMessageArgType(vm_s) != OSETT_INT32)
+    {
+        return;
+    }
+    id = ose_popInt32(vm_s);
+    s = getsession(osevm, id);
+    if(id == 0 || !s)
+    {
+        return;
+    }
+    free(heapbuf(s->le));
+    setheapbuf(s->le, NULL);
+#ifdef OSE_LINED_HISTFILE
+    if(ose_getBundlePtr(s->lh) != ose_getBundlePtr(sessions[0].lh))
+    {
+        const int32_t fd = ose_readInt32(s->lh, HISTFD_OFFSET);
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        ose_writeInt32(s->lh, HISTFD_OFFSET, -1);
+    }
+#endif
+    ose_getBundlePtr(cachedls)[SESSIONSTATE_OFFSET + id] &= ~SESSION_INUSE;
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+  Pops a session id and runs the primitive f on that session.
+  Nothing happens if the session isn't in use.
+*/
+static void withsession(ose_bundle osevm, void (*f)(ose_bundle))
+{
+    ose_bundle vm_s = OSEVM_STACK(osevm);
+    struct session *s;
+    int32_t id;
+    resolve(osevm);
+    if(!ose_bundleHasAtLeastNElems(vm_s, 1)
+       || ose_peekType(vm_s) != OSETT_MESSAGE
+       || ose_peekMessageArgType(vm_s) != OSETT_INT32)
+    {
+        return;
+    }
+    id = ose_popInt32(vm_s);
+    s = getsession(osevm, id);
+    if(!s)
+    {
+        return;
+    }
+    cur = s;
+    curid = id;
+    f(osevm);
+    cur = sessions;
+    curid = -1;
+}
+
+static void ose_lined_sessionChar(ose_bundle osevm)
+{
+    withsession(osevm, ose_lined_char);
+}
+
+static void ose_lined_sessionPrint(ose_bundle osevm)
+{
+    withsession(osevm, ose_lined_print);
+}
+
+static void ose_lined_sessionPrompt(ose_bundle osevm)
+{
+    withsession(osevm, ose_lined_prompt);
+}
+
+static void ose_lined_sessionAddToHist(ose_bundle osevm)
+{
+    withsession(osevm, ose_lined_addToHist);
+}
+
+static void ose_lined_sessionBindKey(ose_bundle osevm)
+{
+    withsession(osevm, ose_lined_bindKey);
+}
+
+void ose_main(ose_bundle osevm)
+{
+    /* session table */
+    ose_pushContextMessage(osevm, 256, "/ls");
+    cachedls = ose_enter(osevm, "/ls");
+    ose_pushMessage(cachedls, "/ss", 3, 1,
+                    OSETT_BLOB, OSE_LINED_MAXSESSIONS, NULL);
+    memset(ose_getBundlePtr(cachedls) + SESSIONSTATE_OFFSET, 0,
+           OSE_LINED_MAXSESSIONS);
+    /* completion index */
+    ose_pushContextMessage(osevm,
+                           OSE_LINED_COMPLETEMAX * 4
+                           + OSE_LINED_COMPLETEDATASIZE + 256,
+                           "/lc");
+    cachedlc = ose_enter(osevm, "/lc");
+    ose_pushMessage(cachedlc, "/cn", 3, 6,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, OSE_BUNDLE_HEADER_LEN,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0,
+                    OSETT_INT32, 0);
+    ose_pushMessage(cachedlc, "/cx", 3, 1,
+                    OSETT_BLOB, OSE_LINED_COMPLETEMAX * 4, NULL);
+    ose_pushMessage(cachedlc, "/cd", 3, 1,
+                    OSETT_BLOB, OSE_LINED_COMPLETEDATASIZE, NULL);
+    /* 
+       session 0: /le (main lined bundle), /lo (options), /lh
+       (history), /lk (kill ring), and /lu (undo log)
+    */
+    memset(sessions, 0, sizeof(sessions));
+    makesession(osevm, 0, SESSION_INUSE);
+    cur = sessions;
+    cachedvm = ose_getBundlePtr(osevm);
 
     ose_bundle vm_s = OSEVM_STACK(osevm);
     ose_pushBundle(vm_s);
@@ -744,8 +4363,62 @@ void ose_main(ose_bundle osevm)
                     "/lined/addtohist", strlen("/lined/addtohist"),
                     1, OSETT_ALIGNEDPTR, ose_lined_addToHist);
     ose_push(vm_s);
+#ifdef OSE_LINED_HISTFILE
+    ose_pushMessage(vm_s,
+                    "/lined/hist/load", strlen("/lined/hist/load"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_loadHist);
+    ose_push(vm_s);
+    ose_pushMessage(vm_s,
+                    "/lined/hist/save", strlen("/lined/hist/save"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_saveHist);
+    ose_push(vm_s);
+#endif
+    ose_pushMessage(vm_s,
+                    "/lined/key/bind", strlen("/lined/key/bind"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_bindKey);
+    ose_push(vm_s);
+#ifdef OSE_LINED_STATS
+    ose_pushMessage(vm_s, "/lined/stats", strlen("/lined/stats"), 1,
+                    OSETT_ALIGNEDPTR, ose_lined_stats);
+    ose_push(vm_s);
+#endif
+    ose_pushMessage(vm_s,
+                    "/lined/session/new", strlen("/lined/session/new"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_sessionNew);
+    ose_push(vm_s);
+    ose_pushMessage(vm_s,
+                    "/lined/session/free", strlen("/lined/session/free"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_sessionFree);
+    ose_push(vm_s);
+    ose_pushMessage(vm_s,
+                    "/lined/session/char", strlen("/lined/session/char"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_sessionChar);
+    ose_push(vm_s);
+    ose_pushMessage(vm_s,
+                    "/lined/session/print",
+                    strlen("/lined/session/print"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_sessionPrint);
+    ose_push(vm_s);
+    ose_pushMessage(vm_s,
+                    "/lined/session/prompt",
+                    strlen("/lined/session/prompt"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_sessionPrompt);
+    ose_push(vm_s);
+    ose_pushMessage(vm_s,
+                    "/lined/session/addtohist",
+                    strlen("/lined/session/addtohist"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_sessionAddToHist);
+    ose_push(vm_s);
+    ose_pushMessage(vm_s,
+                    "/lined/session/key/bind",
+                    strlen("/lined/session/key/bind"),
+                    1, OSETT_ALIGNEDPTR, ose_lined_sessionBindKey);
+    ose_push(vm_s);
 
-    /* empty bindings for C^c and RET */
+    /* 
+       empty bindings for C^c and RET. RET finds the line on top of
+       a frame and the keys after it; see ose_lined_char.
+    */
     ose_pushMessage(vm_s, "/lined/binding/C^c",
                     strlen("/lined/binding/C^c"), 0);
     ose_pushBundle(vm_s);
@@ -756,7 +4429,22 @@ void ose_main(ose_bundle osevm)
     ose_pushBundle(vm_s);
     ose_push(vm_s);
     ose_push(vm_s);
+#ifdef OSE_LINED_HISTFILE
+    /* leaves the message about the failed write on the stack */
+    ose_pushMessage(vm_s, "/lined/binding/histerror",
+                    strlen("/lined/binding/histerror"), 0);
+    ose_pushBundle(vm_s);
+    ose_push(vm_s);
+    ose_push(vm_s);
+#endif
     ose_pushMessage(vm_s, "/lined/NL", strlen("/lined/NL"), 1,
                     OSETT_STRING, "\n");
     ose_push(vm_s);
+    /* sequences that turn bracketed paste on and off in the terminal */
+    ose_pushMessage(vm_s, "/lined/BPON", strlen("/lined/BPON"), 1,
+                    OSETT_STRING, "\033[?2004h");
+    ose_push(vm_s);
+    ose_pushMessage(vm_s, "/lined/BPOFF", strlen("/lined/BPOFF"), 1,
+                    OSETT_STRING, "\033[?2004l");
+    ose_push(vm_s);
 }
@@ -0,0 +1,485 @@
+/*
+  Copyright (c) 2019-22 John MacCallum Permission is hereby granted,
+  free of charge, to any person obtaining a copy of this software
+  and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the
+  rights to use, copy, modify, merge, publish, distribute,
+  sublicense, and/or sell copies of the Software, and to permit
+  persons to whom the Software is furnished to do so, subject to the
+  following conditions:
+
+  The above copyright notice and this permission notice shall be
+  included in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+  DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+  Keystroke replay benchmark for lined. Built and run by make bench.
+
+  A trace is a series of reads from the terminal, each passed to
+  /lined/char in one call, and each frame is rendered with
+  /lined/print. Submitted lines go through /lined/addtohist. The time
+  for each read, including its render, is measured. Each trace
+  prints one line of JSON:
+
+  {"bench":"typing","keys":...,"reads":...,"keys_per_sec":...,
+   "read_ns_p50":...,"read_ns_p90":...,"read_ns_p99":...,
+   "read_ns_max":...,"key_ns_p50":...,"key_ns_p90":...,
+   "key_ns_p99":...,"key_ns_max":...,"bytes_rendered":...}
+
+  where the read_ns_ fields are percentiles of the time per read,
+  and the key_ns_ fields percentiles of the time per key: each key
+  is taken to cost the time of its read over the keys in the read,
+  so each byte of a 4 KB paste is a sample. bytes_rendered counts
+  everything /lined/print wrote, including the echo of the lines
+  submitted in the middle of a read and the prompts after them.
+
+  With no arguments, synthetic traces are replayed: typing, 4 KB
+  bracketed pastes, word kills, C-p scans over a full history, and
+  chunks of several lines each passed to /lined/char as one blob.
+  Otherwise each argument is a file of raw terminal input recorded
+  from a session, replayed a byte per read.
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+#include "ose_lined.c"
+
+#ifndef OSE_LINED_BENCH_VMSIZE
+#define OSE_LINED_BENCH_VMSIZE (1 << 22)
+#endif
+/* times each synthetic trace is repeated */
+#ifndef OSE_LINED_BENCH_REPS
+#define OSE_LINED_BENCH_REPS 20
+#endif
+
+/* the keys, and the offset in keys where each read ends */
+struct trace
+{
+    char *keys;
+    int32_t len;
+    int32_t size;
+    int32_t *ends;
+    int32_t nreads;
+    int32_t readsize;
+    /* reads are passed as a blob rather than an int per byte */
+    int raw;
+};
+
+/*
+  realloc that exits if there isn't the memory: ose_assert is
+  compiled out of the release build the bench is run from
+*/
+static void *xrealloc(void *p, size_t n)
+{
+    void * const q = realloc(p, n);
+    if(!q)
+    {
+        fprintf(stderr, "ose_lined_bench: out of memory\n");
+        exit(1);
+    }
+    return q;
+}
+
+/* appends a read of n bytes */
+static void traceadd(struct trace *t, const char *s, int32_t n)
+{
+    if(t->len + n > t->size)
+    {
+        t->size = (t->len + n) * 2;
+        t->keys = xrealloc(t->keys, t->size);
+    }
+    if(t->nreads == t->readsize)
+    {
+        t->readsize = t->readsize * 2 + 64;
+        t->ends = xrealloc(t->ends, t->readsize * sizeof(*t->ends));
+    }
+    memcpy(t->keys + t->len, s, n);
+    t->len += n;
+    t->ends[t->nreads++] = t->len;
+}
+
+static void tracefree(struct trace *t)
+{
+    free(t->keys);
+    free(t->ends);
+}
+
+static void traceaddc(struct trace *t, char c)
+{
+    traceadd(t, &c, 1);
+}
+
+static uint32_t rnd = 1;
+
+static uint32_t nextrnd(void)
+{
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 17;
+    rnd ^= rnd << 5;
+    return rnd;
+}
+
+/* writes n bytes of words made of lowercase letters */
+static void words(char *s, int32_t n)
+{
+    int32_t i;
+    for(i = 0; i < n; i++)
+    {
+        s[i] = nextrnd() % 6 ? 'a' + nextrnd() % 26 : ' ';
+    }
+}
+
+/* appends n bytes of words, typed a key per read */
+static void traceword(struct trace *t, int32_t n)
+{
+    char s[256];
+    int32_t i;
+    ose_assert(n <= (int32_t)sizeof(s));
+    words(s, n);
+    for(i = 0; i < n; i++)
+    {
+        traceaddc(t, s[i]);
+    }
+}
+
+static void typing(struct trace *t)
+{
+    int32_t i;
+    for(i = 0; i < OSE_LINED_BENCH_REPS * 10; i++)
+    {
+        traceword(t, 60);
+        traceaddc(t, RET);
+    }
+}
+
+/* each paste arrives in a single read */
+static void pastes(struct trace *t)
+{
+    char s[4096 + 12];
+    int32_t i;
+    memcpy(s, "\033[200~", 6);
+    memcpy(s + 6 + 4096, "\033[201~", 6);
+    for(i = 0; i < OSE_LINED_BENCH_REPS; i++)
+    {
+        words(s + 6, 4096);
+        traceadd(t, s, sizeof(s));
+        traceaddc(t, CTRL('a'));
+        traceaddc(t, CTRL('k'));
+    }
+}
+
+static void wordkills(struct trace *t)
+{
+    int32_t i, j;
+    for(i = 0; i < OSE_LINED_BENCH_REPS * 5; i++)
+    {
+        traceword(t, 200);
+        for(j = 0; j < 40; j++)
+        {
+            traceaddc(t, ESC);
+            traceaddc(t, DEL);
+        }
+        traceaddc(t, CTRL('a'));
+        traceaddc(t, CTRL('k'));
+    }
+}
+
+/* lines of words ending in RET, several to a read */
+static void chunks(struct trace *t)
+{
+    char s[8 * 61];
+    int32_t i, j;
+    t->raw = 1;
+    for(i = 0; i < OSE_LINED_BENCH_REPS * 10; i++)
+    {
+        for(j = 0; j < 8; j++)
+        {
+            words(s + j * 61, 60);
+            s[j * 61 + 60] = RET;
+        }
+        traceadd(t, s, sizeof(s));
+    }
+}
+
+/* the history is filled before this trace is replayed */
+static void histscan(struct trace *t)
+{
+    int32_t i, j;
+    for(i = 0; i < OSE_LINED_BENCH_REPS; i++)
+    {
+        for(j = 0; j < OSE_LINED_HISTMAX; j++)
+        {
+            traceaddc(t, CTRL('p'));
+        }
+        for(j = 0; j < OSE_LINED_HISTMAX; j++)
+        {
+            traceaddc(t, CTRL('n'));
+        }
+    }
+}
+
+static ose_bundle vm, vm_s, vm_c;
+static int64_t bytesrendered;
+
+/* the time a read took, and the number of keys in it */
+struct sample
+{
+    int64_t ns;
+    int32_t keys;
+};
+static struct sample *samples;
+
+static int64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void clearstack(void)
+{
+    while(ose_bundleHasAtLeastNElems(vm_s, 1))
+    {
+        ose_drop(vm_s);
+    }
+}
+
+/* leaves only the item standing in for the running program */
+static void clearcontrol(void)
+{
+    while(ose_bundleHasAtLeastNElems(vm_c, 2))
+    {
+        ose_drop(vm_c);
+    }
+}
+
+/*
+  Renders the frame on top of the stack, or, if a line was
+  submitted, adds it to the history, renders the frame under it, and
+  renders a new prompt. Keys that came after the line in its batch
+  are left under the frame, and are passed back to /lined/char.
+*/
+static void render(void)
+{
+    while(ose_peekMessageArgType(vm_s) == OSETT_STRING)
+    {
+        ose_lined_addToHist(vm);
+        ose_drop(vm_s);
+        ose_lined_print(vm);
+        bytesrendered += strlen(ose_peekString(vm_s));
+        ose_drop(vm_s);
+        clearcontrol();
+        ose_lined_prompt(vm);
+        ose_lined_print(vm);
+        bytesrendered += strlen(ose_peekString(vm_s));
+        ose_drop(vm_s);
+        if(!ose_bundleHasAtLeastNElems(vm_s, 1))
+        {
+            return;
+        }
+        ose_lined_char(vm);
+        if(!ose_bundleHasAtLeastNElems(vm_s, 1))
+        {
+            return;
+        }
+    }
+    ose_lined_print(vm);
+    bytesrendered += strlen(ose_peekString(vm_s));
+    clearstack();
+}
+
+/* passes n keys to /lined/char in one call */
+static void keys(const char *s, int32_t n, int raw)
+{
+    int32_t i;
+    if(raw)
+    {
+        ose_pushBlob(vm_s, n, s);
+    }
+    else
+    {
+        for(i = n - 1; i >= 0; i--)
+        {
+            ose_pushInt32(vm_s, (unsigned char)s[i]);
+        }
+        ose_pushInt32(vm_s, n);
+    }
+    ose_lined_char(vm);
+    if(ose_bundleHasAtLeastNElems(vm_s, 1))
+    {
+        render();
+    }
+}
+
+static int cmpread(const void *a, const void *b)
+{
+    const int64_t x = ((const struct sample *)a)->ns;
+    const int64_t y = ((const struct sample *)b)->ns;
+    return x < y ? -1 : x > y;
+}
+
+/* by time per key, compared without dividing */
+static int cmpkey(const void *a, const void *b)
+{
+    const struct sample *x = a, *y = b;
+    const int64_t l = x->ns * y->keys, r = y->ns * x->keys;
+    return l < r ? -1 : l > r;
+}
+
+/*
+  Returns the time per key at percentile pct of the keys in the n
+  samples, which are sorted by cmpkey.
+*/
+static int64_t keypct(const struct sample *s, int32_t n, int64_t keys,
+                      int pct)
+{
+    const int64_t k = keys * pct / 100;
+    int64_t seen = 0;
+    int32_t i;
+    for(i = 0; i < n - 1; i++)
+    {
+        seen += s[i].keys;
+        if(seen > k)
+        {
+            break;
+        }
+    }
+    return s[i].ns / s[i].keys;
+}
+
+static void replay(const char *name, const struct trace *t)
+{
+    const int32_t n = t->nreads;
+    int64_t total = 0;
+    int64_t readns[4];
+    int32_t i, start = 0;
+    if(n == 0)
+    {
+        return;
+    }
+    samples = xrealloc(samples, n * sizeof(*samples));
+    bytesrendered = 0;
+    for(i = 0; i < n; i++)
+    {
+        const int64_t t0 = now();
+        keys(t->keys + start, t->ends[i] - start, t->raw);
+        samples[i].ns = now() - t0;
+        samples[i].keys = t->ends[i] - start;
+        total += samples[i].ns;
+        start = t->ends[i];
+    }
+    qsort(samples, n, sizeof(*samples), cmpread);
+    readns[0] = samples[n / 2].ns;
+    readns[1] = samples[n * 9 / 10].ns;
+    readns[2] = samples[n * 99 / 100].ns;
+    readns[3] = samples[n - 1].ns;
+    qsort(samples, n, sizeof(*samples), cmpkey);
+    printf("{\"bench\":\"%s\",\"keys\":%d,\"reads\":%d,"
+           "\"keys_per_sec\":%.0f,"
+           "\"read_ns_p50\":%lld,\"read_ns_p90\":%lld,"
+           "\"read_ns_p99\":%lld,\"read_ns_max\":%lld,"
+           "\"key_ns_p50\":%lld,\"key_ns_p90\":%lld,"
+           "\"key_ns_p99\":%lld,\"key_ns_max\":%lld,"
+           "\"bytes_rendered\":%lld}\n",
+           name, (int)t->len, (int)n,
+           total > 0 ? t->len * 1e9 / total : 0.,
+           (long long)readns[0], (long long)readns[1],
+           (long long)readns[2], (long long)readns[3],
+           (long long)keypct(samples, n, t->len, 50),
+           (long long)keypct(samples, n, t->len, 90),
+           (long long)keypct(samples, n, t->len, 99),
+           (long long)(samples[n - 1].ns / samples[n - 1].keys),
+           (long long)bytesrendered);
+}
+
+static void fillhist(void)
+{
+    int32_t i;
+    for(i = 0; i < OSE_LINED_HISTMAX; i++)
+    {
+        char s[31];
+        words(s, 30);
+        s[30] = 0;
+        ose_pushString(vm_s, s);
+        ose_lined_addToHist(vm);
+        clearstack();
+    }
+}
+
+static void synthetic(const char *name, void (*make)(struct trace *))
+{
+    struct trace t = { NULL, 0, 0, NULL, 0, 0, 0 };
+    make(&t);
+    replay(name, &t);
+    tracefree(&t);
+}
+
+static int recorded(const char *path)
+{
+    struct trace t = { NULL, 0, 0, NULL, 0, 0, 0 };
+    char buf[4096];
+    size_t n, i;
+    FILE *fp = fopen(path, "rb");
+    if(!fp)
+    {
+        perror(path);
+        return 1;
+    }
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        for(i = 0; i < n; i++)
+        {
+            traceaddc(&t, buf[i]);
+        }
+    }
+    fclose(fp);
+    replay(path, &t);
+    tracefree(&t);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *bytes = xrealloc(NULL, OSE_LINED_BENCH_VMSIZE);
+    int ret = 0;
+    int i;
+    vm = osevm_init(ose_newBundleFromCBytes(OSE_LINED_BENCH_VMSIZE,
+                                            bytes));
+    ose_main(vm);
+    vm_s = OSEVM_STACK(vm);
+    vm_c = OSEVM_CONTROL(vm);
+    clearstack();
+    ose_pushString(vm_c, "/bench");
+    ose_lined_prompt(vm);
+    ose_lined_print(vm);
+    clearstack();
+    if(argc > 1)
+    {
+        for(i = 1; i < argc; i++)
+        {
+            ret |= recorded(argv[i]);
+        }
+    }
+    else
+    {
+        synthetic("typing", typing);
+        synthetic("paste", pastes);
+        synthetic("wordkill", wordkills);
+        fillhist();
+        synthetic("histscan", histscan);
+        synthetic("chunks", chunks);
+    }
+    free(samples);
+    free(bytes);
+    return ret;
+}